@@ -9,6 +9,9 @@
 using namespace Qumat;
 using namespace Qugate;
 
+// Measurements of the top register per Shor trial, all post-processed together
+#define SHOR_SHOTS 32
+
 uint64_t deutsch_josza_parity(int nbit, uint64_t secret_u, bool dense)
 {
 	if (secret_u > (1 << nbit))
@@ -25,12 +28,10 @@ uint64_t deutsch_josza_parity(int nbit, uint64_t secret_u, bool dense)
 		return bitwise_dot(x, secret_u);
 	};
 
-	// output bit init to 1, all others 0
+	// output bit init to 1, all others 0, then hadamard on all
 	Qureg q = dense ? 
-		Qureg::create<true>(nbit + 1, qubase(1)) :
-		Qureg::create<false>(nbit + 1, 1 << (nbit + 1), qubase(1));
-
-	hadamard(q);
+		Qureg::create_uniform<true>(nbit + 1, 0, -1, qubase(1)) :
+		Qureg::create_uniform<false>(nbit + 1, 0, -1, qubase(1));
 
 	apply_oracle(q, oracle, nbit);
 
@@ -99,139 +100,255 @@ std::pair<Qureg, uint64_t> simon_period(int nbit, uint64_t period, bool dense)
 	return pair<Qureg, uint64_t>(move(q), result);
 }
 
-Qureg qft_period(int nbit, uint64_t period, bool dense /* = true */)
+/*
+ *	Helper: measure the output register of |x>|f(x)> first. That is a classical 
+ * draw of f(x0) for a uniform x0, and it leaves the input register in the 
+ * comb of every x with f(x) = f(x0), which is all we build
+ */
+INLINE Qureg comb_state(int nbit, const oracle_function& f, bool dense)
 {
-	Qureg q = dense ? 
-		Qureg::create<true>(nbit * 2, qubase(0)) :
-		Qureg::create<false>(nbit * 2, 1 << nbit, qubase(0));
+	const uint64_t N = uint64_t(1) << nbit;
+	// x0 can pass 32 bits: draw it from a 64-bit engine seeded off the rand_next() stream
+	std::mt19937_64 engine(rand_next());
+	const uint64_t fx0 = f(std::uniform_int_distribution<uint64_t>(0, N - 1)(engine));
+	vector<qubase> comb;
+	for (uint64_t x = 0; x < N; ++x)
+		if (f(x) == fx0)
+			comb.push_back(x);
+
+	const CX a = CX(1 / sqrt(float(comb.size())));
+	Qureg q = dense ?
+		Qureg::create<true>(nbit, comb[0]) :
+		Qureg::create<false>(nbit, comb.size());
+	for (qubase x : comb)
+		if (dense)
+			q.set_base_d(x, a);
+		else
+			q.add_base(x, a);
+	return q;
+}
 
-	qft(q, 0, nbit);
+Qureg qft_period(int nbit, uint64_t period, bool dense /* = true */, bool comb /* = false */)
+{
+	if (comb)
+	{
+		Qureg q = comb_state(nbit, [=](uint64_t x){ return x % period + 1; }, dense);
+		qft(q, 0, nbit);
+		return q;
+	}
+
+	// qft of |0> on the top n qubits
+	Qureg q = dense ? 
+		Qureg::create_uniform<true>(nbit * 2, 0, nbit) :
+		Qureg::create_uniform<false>(nbit * 2, 0, nbit);
 
 	apply_oracle(q, [=](uint64_t x){ return x % period + 1; }, nbit);
 
-	// This measurement shouldn't really matter
-	for (int tar = nbit + 1; tar < nbit * 2; ++tar)
-		measure(q, tar);
+	// This measurement shouldn't really matter. 
+	// Drop the measured qubits, from the last one so indices stay put
+	for (int tar = nbit * 2 - 1; tar > nbit; --tar)
+		measure_and_remove(q, tar);
 
 	qft(q, 0, nbit);
 
 	return q;
 }
 
-std::pair<int, int> shor_factorize(int nbit, int M, bool dense)
+/*
+ *	Helper: one run of the Griffiths-Niu semi-classical phase estimation of b^x mod M.
+ * Qubit 0 is the control, recycled by reset() after every bit. Qubits 1.. hold y, from |1>.
+ * Bits of m come out lowest first, each after a phase correction by the bits measured so far.
+ * Return m, m / 2^nbit ~ s / r
+ */
+INLINE uint64_t shor_semi_classical(int nbit, int M, int b, bool dense)
 {
-	Qureg q0 = dense ?
-		Qureg::create<true>(nbit * 2, qubase(0)) :
-		Qureg::create<false>(nbit * 2, 1 << nbit, qubase(0));
+	int ybit = 1;
+	while ((1 << ybit) < M) ++ybit;
+	Qureg q = dense ?
+		Qureg::create<true>(ybit + 1, qubase(1)) :
+		Qureg::create<false>(ybit + 1, size_t(1) << ybit, qubase(1));
+	vector<int> ys(ybit), ctrl(1, 0);
+	for (int i = 0; i < ybit; ++i) ys[i] = i + 1;
+
+	// a[j] = b^(2^j) mod M
+	vector<uint64_t> a(nbit);
+	a[0] = b % M;
+	for (int j = 1; j < nbit; ++j)
+		a[j] = a[j - 1] * a[j - 1] % M;
+
+	const uint64_t modulus = M;
+	uint64_t m = 0;
+	for (int j = 0; j < nbit; ++j)
+	{
+		hadamard(q, 0);
+		// controlled U^(2^(nbit-1-j)):  |y> -> |a y mod M>
+		uint64_t aj = a[nbit - 1 - j];
+		apply_permutation(q, [=](uint64_t y) { return y < modulus ? y * aj % modulus : y; }, ys, ctrl);
+		// classically controlled phase: cancel the bits already known
+		if (m)
+			phase_shift(q, -2 * PI * m / (uint64_t(2) << j), 0);
+		hadamard(q, 0);
+		m |= uint64_t(reset(q, 0)) << j;
+	}
+	return m;
+}
+
+/*
+ *	Helper: one Shor trial with base b. Return the measured top registers, 
+ * m / 2^nbit ~ s / r. q0 is only read (Standard mode), so trials can run concurrently
+ */
+INLINE vector<uint64_t> shor_trial(int nbit, int M, int b, bool dense, ShorMode mode, Qureg& q0)
+{
+	vector<uint64_t> measurements;
+	if (mode == ShorMode::Standard)
+	{
+		// Shor's circuit goes here
+		Qureg q = q0.clone();
+
+		apply_oracle(q, shor_oracle(b, M), nbit);
+
+		qft(q, 0, nbit);
+
+		// measurement shots are cheap once the sampling table is built
+		vector<int> topQubits(nbit);
+		for (int qi = 0; qi < nbit; ++qi) topQubits[qi] = qi;
+		measurements = sample(q, SHOR_SHOTS, topQubits);
+	}
+	else if (mode == ShorMode::Comb)
+	{
+		Qureg q = comb_state(nbit, shor_oracle(b, M), dense);
+		qft(q, 0, nbit);
+		measurements = sample(q, SHOR_SHOTS);
+	}
+	else
+		// mid-circuit measurements: every shot is a run of its own, so take fewer
+		for (int trial = 0; trial < SHOR_SHOTS / 4; ++trial)
+			measurements.push_back(shor_semi_classical(nbit, M, b, dense));
+	return measurements;
+}
+
+/*
+ *	Helper: run trials (or moduli) on all threads only while their registers 
+ * are too small for the kernels' own OMP_FOR. Each thread holds its own copy,
+ * and the kernel loops nested inside would run serially anyway
+ */
+INLINE bool shor_parallel_trials(int nbit, ShorMode mode)
+{
+	// Comb has nbit qubits, semi-classical 1 + log2(M), fewer than nbit
+	const int nqubit = mode == ShorMode::Standard ? 2 * nbit : nbit;
+	return (int64_t(1) << nqubit) <= PARALLEL_MIN;
+}
 
-	// top n qubits
-	qft(q0, 0, nbit);
+std::pair<int, int> shor_factorize(int nbit, int M, bool dense, ShorMode mode)
+{
+	Qureg q0;
+	if (mode == ShorMode::Standard)
+	{
+		// qft of |0> on the top n qubits
+		q0 = dense ?
+			Qureg::create_uniform<true>(nbit * 2, 0, nbit) :
+			Qureg::create_uniform<false>(nbit * 2, 0, nbit);
+	}
 
 	// Don't try b's already tried
 	unordered_set<int> bTriedSet;
 	// If the hash set is more than 2/3 filled, we try all the rest values sequentially
 	bool hashMode = true;
 	vector<int> remainings; // b values we haven't tried yet
-	int b, i;
-	while (1)
+	int i = 0;
+	pair<int, int> ans(0, 0);
+	// set by the first trial that factors M, the others stop at their next pick
+	std::atomic<bool> found(false);
+	// bases and trial seeds come from one stream, in pick order
+	std::mt19937 picker(rand_next());
+
+	// Every thread runs trials with its own b until one succeeds or all b are tried
+	OMP_PARALLEL(shor_parallel_trials(nbit, mode))
+	while (!found)
 	{
-		if (hashMode && bTriedSet.size() < M * 2.0 / 3)
+		int b = 0;
+		unsigned seed = 0;
+		OMP_CRITICAL(shor_pick_base)
 		{
-			// the random picked base must be co-prime with M
-			b = rand_int(2, M);
-
-			if (contains(bTriedSet, b))
-				continue;
-			else
-				bTriedSet.insert(b);
-		}
-		else
-		{
-			// init the vector once
-			if (hashMode)
+			RandScope pick(picker);
+			seed = rand_next();
+			while (1)
 			{
-				hashMode = false;
-				i = 0;
-				for (int btmp = 2; btmp < M ; ++btmp)
-					if (!contains(bTriedSet, btmp))
-						remainings.push_back(btmp);
-			}
-			if (i < remainings.size())
-				b = remainings[i++];
-			else
-				break; // we tried every b and failed. Break the infinite loop
-		}
-
-		if (gcd(b, M) != 1) continue;
-
-		// Shor's circuit goes here
-		Qureg q = q0.clone();
-
-		apply_oracle(q, shor_oracle(b, M), nbit);
-
-		qft(q, 0, nbit);
+				if (hashMode && bTriedSet.size() < M * 2.0 / 3)
+				{
+					// the random picked base must be co-prime with M
+					b = rand_int(2, M);
 
-		int mTrial = 0; // measurement trial
-		int measured;
-		
-		while (mTrial++ < 10)
-			// If 0, measure again
-			if ((measured = measure_top(q, nbit, false)) != 0)
-			{
-				// Use continued fraction approximation of {N / measured = r / k}
-				ContFrac cfrac = to_cont_frac(Frac(1 << nbit, measured));
-				// We reduce the continued fraction more and more to get a simpler approximate fraction
-				for (int size = cfrac.size(); size >= 1 ; --size)
+					if (contains(bTriedSet, b))
+						continue;
+					else
+						bTriedSet.insert(b);
+				}
+				else
 				{
-					// the actual period can be a multiple of p
-					int p = to_frac(cfrac, size).num;
-					int P = p;
-					// 64-bit long long limit
-					while (P < 128 && P < M)
+					// init the vector once
+					if (hashMode)
 					{
-						if (P % 2 == 0
-							&& exp_mod(b, P, M) == 1)
-						{
-							// further check  b^(p/2) != +/-1 mod M
-							int check = exp_mod(b, P / 2, M);
-							if (check != 1 && check != M - 1)
-							{
-								//pr("Almost there b = " << b << "; p = " << p << "; P = " << P 
-								//   << "; cfrac = " << to_frac(cfrac, size) << " VS " << to_frac(cfrac));
-								// We almost found it. Might have some numerical overflow here:
-								uint64_t b_P_1 = long_pow(b, P / 2) - 1;
-								int prime = gcd(M, b_P_1);
-								// due to overflow, prime might become +/-1
-								if (prime != 1 && prime != -1)
-								{
-									pr("Found period r = " << P);
-									pr("b ^ r = " << b << " ^ " << P << " = 1 mod " << M);
-									pr("b ^ (r/2) = " << b << " ^ " << P / 2 << " = " << check << " mod " << M);
-									int prime2 = gcd(M, b_P_1 + 2); // b^(P/2) + 1
-									pr("gcd(" << M << ", " << b_P_1 << ") = " << prime);
-									pr("gcd(" << M << ", " << b_P_1 + 2 << ") = " << prime2);
-									return pair<int, int>(prime, prime2 == 1 ? M / prime : prime2);
-								}
-							}
-						}
-						// Try the next multiple of p, the next candidate of a possible period hit
-						P += p;
+						hashMode = false;
+						for (int btmp = 2; btmp < M ; ++btmp)
+							if (!contains(bTriedSet, btmp))
+								remainings.push_back(btmp);
 					}
+					// b = 0: we tried every b
+					b = i < remainings.size() ? remainings[i++] : 0;
 				}
+				if (b == 0 || gcd(b, M) == 1)
+					break;
+			}
+		}
+		if (b == 0)
+			break; // we tried every b and failed. Break the infinite loop
+
+		vector<uint64_t> measurements;
+		{
+			// the trial's sample(), comb_state() and reset() draw from its own seed
+			RandScope trialRand(seed);
+			measurements = shor_trial(nbit, M, b, dense, mode, q0);
+		}
+
+		OMP_CRITICAL(shor_post_process)
+		if (!found)
+		{
+			auto factors = shor_post_process(nbit, M, b, measurements);
+			if (factors.first != 0)
+			{
+				ans = factors;
+				found = true;
 			}
+		}
 	}
-	// We failed!!! ;(
-	return std::pair<int, int>(0, 0);
+	// (0, 0) if we failed!!! ;(
+	return ans;
+}
+
+vector<std::pair<int, int>> shor_factorize_batch(int nbit, const vector<int>& Ms, bool dense, ShorMode mode)
+{
+	vector<pair<int, int>> factors(Ms.size());
+	// seeds drawn up front, so the result doesn't depend on the thread count
+	vector<unsigned> seeds(Ms.size());
+	for (auto& seed : seeds)
+		seed = rand_next();
+	// one modulus per thread. The trials inside each shor_factorize run on that thread
+	OMP_FOR_TASKS(shor_parallel_trials(nbit, mode))
+	for (int64_t m = 0; m < int64_t(Ms.size()); ++m)
+	{
+		RandScope modulusRand(seeds[m]);
+		factors[m] = shor_factorize(nbit, Ms[m], dense, mode);
+	}
+	return factors;
 }
 
 void shor_factorize_verbose(int nbit, int M, bool dense)
 {
+	// qft of |0> on the top n qubits
 	Qureg q0 = dense ? 
-		Qureg::create<true>(nbit * 2, qubase(0)) :
-		Qureg::create<false>(nbit * 2, 1 << nbit, qubase(0));
-
-	// top n qubits
-	qft(q0, 0, nbit);
+		Qureg::create_uniform<true>(nbit * 2, 0, nbit) :
+		Qureg::create_uniform<false>(nbit * 2, 0, nbit);
 
 	// randomly pick a base
 	for (int b : Range<>(2, M/2))
@@ -244,29 +361,27 @@ void shor_factorize_verbose(int nbit, int M, bool dense)
 		apply_oracle(q, shor_oracle(b, M), nbit);
 
 		// This measurement shouldn't really matter
-		for (int tar = nbit + 1; tar < nbit * 2; ++tar)
-			measure(q, tar);
+		for (int tar = nbit * 2 - 1; tar > nbit; --tar)
+			measure_and_remove(q, tar);
 
 		qft(q, 0, nbit);
 
 		// verification
 		int period = smallest_period(b, M);
-		auto sorted = q.sorted_non_zero_states();
+		float expectProb = 1.0 / period;
+		// The measurement is unlikely to happen below .7 * expectProb
+		auto sorted = q.top_k_states(0, expectProb * .7);
 
 		pr("-------");
 		pr("Smallest period: " << b << " ^ " << period << " = 1 mod " << M);
-		float expectProb = 1.0 / period;
 		pr("Measurement (m) should be multiple of " << (1 << nbit)*1.0 / period);
 		pr("Expected prob 1/r = " << expectProb);
 		pr("m\tm*r/N\t\tprob");
 		for (int i = 0; i < sorted.size(); ++i)
 		{
-			int base = sorted[i].first >> nbit;
+			int base = sorted[i].first >> (q.nqubit - nbit);
 			float prob = sorted[i].second;
 
-			// The measurement is unlikely to happen
-			if (prob < expectProb * .7)  break;
-
 			// measured * r / N  should be very close to the nearest integer
 			pr(base << setprecision(5) << "\t" << (1.0*base*period / (1 << nbit)) << "\t\t" << prob);
 		}
@@ -276,19 +391,16 @@ void shor_factorize_verbose(int nbit, int M, bool dense)
 std::pair<uint64_t, vector<float>> 
 grover_search(int nbit, uint64_t key, bool dense /* = true */)
 {
-	// the last output bit init to 1
+	// the last output bit init to 1. Init by superposition
 	Qureg q = dense ?
-		Qureg::create<true>(nbit + 1, qubase(1)) :
-		Qureg::create<false>(nbit + 1, 1 << nbit, qubase(1));
+		Qureg::create_uniform<true>(nbit + 1, 0, -1, qubase(1)) :
+		Qureg::create_uniform<false>(nbit + 1, 0, -1, qubase(1));
 
 	oracle_function oracle = [=](uint64_t x) { return x == key; };
 
 	int64_t N = 1 << nbit;
 	int sqrtN = floor(sqrt(N));
 
-	// Init by superposition
-	hadamard(q);
-
 	uint64_t ans;
 	vector<float> probAtKey(sqrtN * 2);
 
@@ -319,12 +431,7 @@ grover_search(int nbit, uint64_t key, bool dense /* = true */)
 vector<CX> teleport(Qureg& qa, bool dense)
 {
 	// Create a bell state in B register
-	Qureg qb = dense ?
-		Qureg::create<true>(2, qubase(0)) :
-		Qureg::create<false>(2, 1<<2, qubase(0));
-
-	hadamard(qb, 0);
-	cnot(qb, 0, 1);
+	Qureg qb = dense ? Qureg::create_ghz<true>(2) : Qureg::create_ghz<false>(2);
 
 	// Connect A and B
 	Qureg q = kronecker(qa, qb, dense);
@@ -335,15 +442,14 @@ vector<CX> teleport(Qureg& qa, bool dense)
 	int measure0 = measure(q, 0);
 	int measure1 = measure(q, 1);
 
-	if (measure1)
-		pauli_X(q, 2);
-	if (measure0)
-		pauli_Z(q, 2);
+	// classical feed-forward, X if measure1 then Z if measure0
+	pauli_correct(q, 2, measure1, measure0);
 
-	auto nonZeroStates = q.non_zero_states();
+	// read qubit 2 where qubits 0 and 1 hold the measured bits.
+	// Non-zero states may come in any order once sparse bases are relabeled
 	vector<CX> amp(2);
 	for (int i = 0; i < 2; ++i)
-		amp[i] = q.get_amp(nonZeroStates[i]);
+		amp[i] = q.get_amp((measure0 << 2) | (measure1 << 1) | i);
 
 	return amp;
 }
@@ -366,6 +472,72 @@ uint64_t exp_mod(uint64_t b, uint64_t e, uint64_t m)
 	return x;
 }
 
+/*
+ *	Helper: if b^r = 1 mod M, r is a multiple of the order of b. Halve r while 
+ * b^(r/2) = 1, then b^(r/2) != -1 is a nontrivial square root of 1 and splits M.
+ * Return (0, 0) otherwise
+ */
+INLINE std::pair<int, int> shor_split(int M, int b, uint64_t r)
+{
+	if (exp_mod(b, r, M) != 1)
+		return std::pair<int, int>(0, 0);
+	while (r % 2 == 0)
+	{
+		uint64_t check = exp_mod(b, r / 2, M);
+		if (check == uint64_t(M) - 1)
+			break;
+		if (check != 1)
+		{
+			// check^2 = 1 mod M, so M divides (check - 1) * (check + 1) but neither
+			int prime = gcd(check - 1, M);
+			pr("Found period r = " << r);
+			pr("b ^ r = " << b << " ^ " << r << " = 1 mod " << M);
+			pr("b ^ (r/2) = " << b << " ^ " << r / 2 << " = " << check << " mod " << M);
+			pr("gcd(" << M << ", " << check - 1 << ") = " << prime);
+			return std::pair<int, int>(prime, M / prime);
+		}
+		r /= 2;
+	}
+	return std::pair<int, int>(0, 0);
+}
+
+std::pair<int, int> shor_post_process(int nbit, int M, int b, const vector<uint64_t>& measurements)
+{
+	// measured / 2^nbit ~ s / r gives r / gcd(s, r): try a few multiples of every
+	// candidate, and the lcm with the candidates of the other measurements
+	const uint64_t maxMultiple = nbit, modulus = M;
+	unordered_set<uint64_t> tried;
+	vector<uint64_t> periods; // convergents of the earlier measurements
+	for (uint64_t measured : measurements)
+	{
+		// If 0, nothing to learn
+		if (measured == 0)
+			continue;
+		vector<uint64_t> denoms = convergent_denoms(measured, uint64_t(1) << nbit, M);
+		vector<uint64_t> candidates = denoms;
+		for (uint64_t r : denoms)
+			for (uint64_t p : periods)
+			{
+				uint64_t l = r / gcd(r, p) * p;
+				if (l < modulus)
+					candidates.push_back(l);
+			}
+		periods.insert(periods.end(), denoms.begin(), denoms.end());
+
+		for (uint64_t r : candidates)
+			for (uint64_t P = r; P < modulus && P <= r * maxMultiple; P += r)
+			{
+				if (contains(tried, P))
+					continue;
+				tried.insert(P);
+				auto factors = shor_split(M, b, P);
+				if (factors.first != 0)
+					return factors;
+			}
+	}
+	return std::pair<int, int>(0, 0);
+}
+
 oracle_function shor_oracle(int b, int M)
 {
 	return
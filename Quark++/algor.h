@@ -20,13 +20,40 @@ std::pair<Qureg, uint64_t> simon_period(int nbit, uint64_t period, bool dense =
 
 /*
  *	Find period of a general f(x) = f(x + r)
+ * The measured output qubits are removed, nbit + 1 qubits are returned
+ * comb: measure the output register first (classically) and simulate only the
+ *   nbit-qubit comb state left on the input register, which is then returned.
+ *   Same measurement statistics on the input register, 2^nbit times less memory
  */
-Qureg qft_period(int nbit, uint64_t period, bool dense = true);
+Qureg qft_period(int nbit, uint64_t period, bool dense = true, bool comb = false);
+
+/*
+ *	How shor_factorize simulates period finding
+ * Standard: 2 * nbit qubits, the whole top register goes through the QFT
+ * SemiClassical: Griffiths-Niu semi-classical QFT. A single control qubit is
+ *   measured and recycled nbit times, with classically controlled phase 
+ *   corrections, so only 1 + log2(M) qubits are simulated
+ * Comb: the output register is measured first, so only the nbit-qubit comb
+ *   state of the input register goes through the QFT (see qft_period)
+ */
+enum class ShorMode { Standard, SemiClassical, Comb };
 
 /*
  *	Return both of the factorized prime
+ * nbit: precision of the period finding, number of top register qubits
+ * With OpenMP, trials with different bases b run on all threads while their
+ * registers are small (larger ones parallelize inside the gates instead),
+ * and the first one to factor M stops the others. Every trial draws from 
+ * its own seeded engine, so its shots don't depend on thread interleaving
+ */
+std::pair<int, int> shor_factorize(int nbit, int M, bool dense = true, 
+	ShorMode mode = ShorMode::Standard);
+/*
+ *	Factorize every M in Ms, one modulus per thread while the registers are small
+ * Return the factors in the order of Ms
  */
-std::pair<int, int> shor_factorize(int nbit, int M, bool dense = true);
+vector<std::pair<int, int>> shor_factorize_batch(int nbit, const vector<int>& Ms, 
+	bool dense = true, ShorMode mode = ShorMode::Standard);
 // Display internal steps
 void shor_factorize_verbose(int nbit, int M, bool dense = true);
 
@@ -54,6 +81,15 @@ uint64_t exp_mod(uint64_t b, uint64_t e, uint64_t m);
  */
 uint64_t long_pow(uint64_t a, int p);
 
+/*
+ *	Shor's classical post-processing. Each measurement is a top register value, 
+ * measured / 2^nbit ~ k / r. The convergent denominators of every measurement, 
+ * their small multiples and their lcm with those of the other measurements are 
+ * the candidate periods of b. All arithmetic is mod M (exp_mod), no overflow.
+ * Return both factors of M, or (0, 0) if the measurements don't reveal them
+ */
+std::pair<int, int> shor_post_process(int nbit, int M, int b, const vector<uint64_t>& measurements);
+
 /*
  *	produce a shor's algorithm oracle
  * f(x) = b^x mod M, where M is the int to be factored
@@ -254,4 +254,33 @@ inline ContFrac to_cont_frac(Frac frac, int size = 0)
 	return cfrac;
 }
 
+/*
+ *	Denominators of the convergents of num / denom, ascending, up to 
+ * the last one below maxDenom. Unsigned 64-bit throughout: unlike 
+ * to_frac(to_cont_frac(...)), no intermediate value exceeds maxDenom
+ */
+inline vector<uint64_t> convergent_denoms(uint64_t num, uint64_t denom, uint64_t maxDenom)
+{
+	vector<uint64_t> denoms;
+	// k_i = a_i * k_(i-1) + k_(i-2), with k_(-1) = 0, k_(-2) = 1
+	uint64_t k1 = 0, k2 = 1;
+	while (denom != 0)
+	{
+		uint64_t a = num / denom;
+		// stop before a * k1 + k2 >= maxDenom
+		if (k1 != 0 && a > (maxDenom - 1 - k2) / k1)
+			break;
+		uint64_t k = a * k1 + k2;
+		if (k >= maxDenom)
+			break;
+		denoms.push_back(k);
+		k2 = k1;
+		k1 = k;
+		uint64_t rem = num % denom;
+		num = denom;
+		denom = rem;
+	}
+	return denoms;
+}
+
 #endif // frac_h__
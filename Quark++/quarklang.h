@@ -140,7 +140,7 @@ void generic_2gate(Q, const Matrix4cf mat, int tar1, int tar2)
 /*
 *	Works with arbitrary number of target qubits
 */
-void generic_ngate(Q, const MatrixXcf mat, vector<int> tars)
+void generic_ngate(Q, const MatrixXcf& mat, const vector<int>& tars)
 {
 	Qugate::generic_gate(q, mat, tars);
 }
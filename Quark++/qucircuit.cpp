@@ -0,0 +1,238 @@
+/**********************************************
+* Gate sequences  *
+**********************************************/
+
+#include "qucircuit.h"
+#include "qugate_helpers.h"
+
+using namespace Qugate;
+
+void Qucircuit::apply(Q, const GateOp& gate)
+{
+	if (gate.ctrls.empty())
+		generic_gate(q, gate.mat, gate.tars);
+	else
+		apply_controlled(q, gate.mat, gate.ctrls, gate.ctrlValues, gate.tars);
+}
+
+void Qucircuit::apply(Q, const Circuit& gates)
+{
+	for (const GateOp& gate : gates)
+		apply(q, gate);
+}
+
+/**********************************************/
+/*********** Blocked execution  ***********/
+/**********************************************/
+/*
+ *	A gate prepared for tile-local execution.
+ * Masks are split into the bits inside a tile (lo) and above it (hi)
+ */
+struct TileGate
+{
+	const MatrixXcf* mat;
+	vector<qubase> offsets; // offsets[i] flips the target bits set in i
+	qubase freeMask; // tile bits that are neither target nor control
+	qubase ctrlOnLo;
+	qubase ctrlMaskHi, ctrlOnHi;
+
+	TileGate(Q, const GateOp& gate, qubase loMask) :
+		mat(&gate.mat)
+	{
+		if (gate.mat.rows() != 1 << gate.tars.size())
+			throw QuantumException(
+				"Unitary matrix must have row/col width 2^(number of target bits)");
+
+		offsets = flip_offsets(q, gate.tars);
+		qubase tarMask = offsets.back();
+		auto masks = control_masks(q, gate.ctrls, gate.ctrlValues, tarMask);
+		qubase ctrlMask = masks.first, ctrlOn = masks.second;
+
+		freeMask = loMask & ~(tarMask | ctrlMask);
+		ctrlOnLo = ctrlOn & loMask;
+		ctrlMaskHi = ctrlMask & ~loMask;
+		ctrlOnHi = ctrlOn & ~loMask;
+	}
+
+	/*
+	 *	Apply to the tile starting at &amp[tileBase]
+	 */
+	MULTI_ISA void apply(CX *tile, qubase tileBase) const
+	{
+		if ((tileBase & ctrlMaskHi) != ctrlOnHi)
+			return;
+
+		if (offsets.size() == 2)
+		{
+			const Matrix2cf m = *mat;
+			const qubase t = offsets[1];
+			MASKED_ITER(base0, freeMask, ctrlOnLo)
+			{
+				CX a0 = tile[base0];
+				CX a1 = tile[base0 | t];
+				tile[base0] = cx_fma(a0, m(0, 0), cx_mul(a1, m(0, 1)));
+				tile[base0 | t] = cx_fma(a0, m(1, 0), cx_mul(a1, m(1, 1)));
+			}
+		}
+		else
+		{
+			const int N = offsets.size();
+			VectorXcf a(N), newa(N);
+			MASKED_ITER(base0, freeMask, ctrlOnLo)
+			{
+				for (int i = 0; i < N; ++i)
+					a(i) = tile[base0 | offsets[i]];
+				newa.noalias() = *mat * a;
+				for (int i = 0; i < N; ++i)
+					tile[base0 | offsets[i]] = newa(i);
+			}
+		}
+	}
+};
+
+// Helper: are all targets inside the lowest 'blockQubits' bits?
+INLINE bool is_tile_local(Q, const GateOp& gate, int blockQubits)
+{
+	for (int tar : gate.tars)
+		if (tar < q.nqubit - blockQubits)
+			return false;
+	return true;
+}
+
+void Qucircuit::blocked_apply(Q, const Circuit& gates, int blockQubits)
+{
+	if (!q.dense)
+	{
+		apply(q, gates);
+		return;
+	}
+	q.settle();
+	blockQubits = min(blockQubits, q.nqubit);
+	const qubase tileSize = qubase(1) << blockQubits;
+	const qubase loMask = tileSize - 1;
+	auto& amp = q.amp;
+
+	vector<TileGate> run;
+	for (size_t g = 0; g < gates.size(); )
+	{
+		if (!is_tile_local(q, gates[g], blockQubits))
+		{
+			apply(q, gates[g++]);
+			continue;
+		}
+		// gather the longest run of tile-local gates
+		run.clear();
+		for (; g < gates.size() && is_tile_local(q, gates[g], blockQubits); ++g)
+			run.push_back(TileGate(q, gates[g], loMask));
+
+		// one pass over memory for the whole run
+		for (qubase tileBase = 0; tileBase < amp.size(); tileBase += tileSize)
+			for (const TileGate& tg : run)
+				tg.apply(&amp[tileBase], tileBase);
+	}
+}
+
+/**********************************************/
+/*********** Qubit reordering  ***********/
+/**********************************************/
+// Memory passes one qubit swap of permute_qubits() costs, in units of one gate sweep.
+// The reorder is a chain of in-place swaps, one full pass each, rather than a
+// single cache-oblivious pass, so a layout change costs one pass per moved qubit
+#define SWAP_COST 1
+
+// Helper: gate with its qubits relabeled through layout[logical] = physical
+INLINE GateOp remap(const GateOp& gate, const vector<int>& layout)
+{
+	GateOp g = gate;
+	for (int& tar : g.tars) tar = layout[tar];
+	for (int& ctrl : g.ctrls) ctrl = layout[ctrl];
+	return g;
+}
+
+// Helper: number of gates in [begin, end) that need a full sweep under layout
+INLINE int count_sweeps(const Circuit& gates, size_t begin, size_t end,
+	const vector<int>& layout, int firstLocal)
+{
+	int sweeps = 0;
+	for (size_t g = begin; g < end; ++g)
+		for (int tar : gates[g].tars)
+			if (layout[tar] < firstLocal)
+			{
+				++sweeps;
+				break;
+			}
+	return sweeps;
+}
+
+void Qucircuit::scheduled_apply(Q, const Circuit& gates, int blockQubits, int lookahead)
+{
+	if (!q.dense)
+	{
+		apply(q, gates);
+		return;
+	}
+	const int n = q.nqubit;
+	blockQubits = min(blockQubits, n);
+	// physical qubits [firstLocal, n) live inside a tile
+	const int firstLocal = n - blockQubits;
+
+	vector<int> layout(n); // logical -> physical
+	for (int i = 0; i < n; ++i) layout[i] = i;
+	vector<int> newLayout, perm(n), score(n), byScore(n);
+	Circuit pending; // remapped gates not yet executed
+
+	for (size_t g = 0; g < gates.size(); ++g)
+	{
+		size_t end = min(gates.size(), g + lookahead);
+		if (count_sweeps(gates, g, g + 1, layout, firstLocal))
+		{
+			// the most used targets in the window become local, 
+			// the current gate's targets unconditionally
+			std::fill(score.begin(), score.end(), 0);
+			for (size_t g1 = g; g1 < end; ++g1)
+				for (int tar : gates[g1].tars)
+					score[tar] += g1 == g ? lookahead : 1;
+			for (int i = 0; i < n; ++i) byScore[i] = i;
+			// ties keep the qubits that are local already
+			std::stable_sort(byScore.begin(), byScore.end(), [&](int l1, int l2)
+			{
+				return score[l1] != score[l2] ? score[l1] > score[l2] : layout[l1] > layout[l2];
+			});
+
+			// chosen qubits keep their slot if already local, 
+			// otherwise swap with an evicted local qubit
+			newLayout = layout;
+			vector<bool> chosen(n, false);
+			for (int i = 0; i < blockQubits; ++i)
+				chosen[byScore[i]] = true;
+			vector<int> incoming, evicted;
+			for (int l = 0; l < n; ++l)
+				if (chosen[l] && layout[l] < firstLocal)
+					incoming.push_back(l);
+				else if (!chosen[l] && layout[l] >= firstLocal)
+					evicted.push_back(l);
+			for (size_t i = 0; i < incoming.size(); ++i)
+				std::swap(newLayout[incoming[i]], newLayout[evicted[i]]);
+
+			// the new layout is one qubit swap per incoming qubit away
+			if (count_sweeps(gates, g, end, layout, firstLocal) - 
+				count_sweeps(gates, g, end, newLayout, firstLocal) > 
+				SWAP_COST * int(incoming.size()))
+			{
+				blocked_apply(q, pending, blockQubits);
+				pending.clear();
+				for (int l = 0; l < n; ++l)
+					perm[layout[l]] = newLayout[l];
+				permute_qubits(q, perm);
+				layout.swap(newLayout);
+			}
+		}
+		pending.push_back(remap(gates[g], layout));
+	}
+	blocked_apply(q, pending, blockQubits);
+
+	// restore the original order
+	for (int l = 0; l < n; ++l)
+		perm[layout[l]] = l;
+	permute_qubits(q, perm);
+}
@@ -0,0 +1,63 @@
+#ifndef qucircuit_h__
+#define qucircuit_h__
+
+#include "qugate.h"
+
+/*
+ *	One gate of a circuit: 'mat' on 'tars', fired only when every ctrl qubit
+ * equals its ctrlValue. No ctrls means an ordinary k-qubit gate.
+ * mat: 2^k square matrix over tars, tars[0] the most significant
+ * ctrlValues: fire on 1 or 0 for each control qubit. Empty means all 1
+ */
+struct GateOp
+{
+	MatrixXcf mat;
+	vector<int> tars;
+	vector<int> ctrls;
+	vector<int> ctrlValues;
+
+	GateOp(const MatrixXcf& mat, const vector<int>& tars,
+		const vector<int>& ctrls = vector<int>(),
+		const vector<int>& ctrlValues = vector<int>()) :
+		mat(mat), tars(tars), ctrls(ctrls), ctrlValues(ctrlValues) { }
+
+	GateOp(const Matrix2cf& mat, int tar) :
+		mat(mat), tars(1, tar) { }
+};
+
+typedef vector<GateOp> Circuit;
+
+namespace Qucircuit
+{
+	/*
+	 *	Apply a single gate with one full sweep over the register
+	 */
+	void apply(Q, const GateOp& gate);
+
+	/*
+	 *	Apply the gates in order, one full sweep each
+	 */
+	void apply(Q, const Circuit& gates);
+
+	/*
+	 *	Cache-blocked execution. amp[] is cut into tiles of 2^blockQubits amplitudes
+	 * (default 2^15 complex floats = 256KB, about an L2 cache).
+	 * A run of consecutive gates whose targets all lie in the lowest blockQubits
+	 * bits is applied tile by tile, so the whole run costs one pass over memory.
+	 * Controls may be anywhere: high controls just skip the tiles they switch off.
+	 * Gates on higher qubits fall back to full sweeps. Sparse runs apply() as is.
+	 */
+	void blocked_apply(Q, const Circuit& gates, int blockQubits = 15);
+
+	/*
+	 *	blocked_apply() with qubit reordering. Qubit 0 has the largest stride,
+	 * so a gate on a low-index qubit can never be tile-local as is.
+	 * Looking 'lookahead' gates ahead, the scheduler moves the most used target
+	 * qubits into the tile bits with permute_qubits() whenever that saves more
+	 * full sweeps than the permutation costs, one sweep per qubit swapped in
+	 * (see permute_qubits). The original qubit order is restored at the end.
+	 */
+	void scheduled_apply(Q, const Circuit& gates, int blockQubits = 15, int lookahead = 64);
+}
+
+#endif // qucircuit_h__
@@ -4,6 +4,7 @@
 
 #include "qureg.h"
 #include "qugate.h"
+#include "qugate_helpers.h"
 #include "qumat.h"
 
 using namespace Qugate;
@@ -12,17 +13,177 @@ using namespace Qumat;
 /**********************************************/
 /*********** Single-qubit gates  ***********/
 /**********************************************/
-// Helper for generic gate
-INLINE void generic_dense_update(
-	vector<CX>& amp, qubase& base0, qubase& t, const Matrix2cf& mat)
+/*
+ * Dense pair kernels. A single-target gate updates every pair
+ * (amp[base], amp[base | t]) through an Op functor: op(a0, a1).
+ * With the target at bit P, the pairs come in contiguous blocks of 2^(P+1)
+ * amplitudes. P = 0..5 get their own instantiation so the inner loop has a
+ * compile-time trip count and unrolls into in-register butterflies.
+ */
+// General 2x2 matrix
+struct MatOp
 {
-	if (!(base0 & t))
+	CX m00, m01, m10, m11;
+	MatOp(const Matrix2cf& mat) :
+		m00(mat(0, 0)), m01(mat(0, 1)), m10(mat(1, 0)), m11(mat(1, 1)) { }
+	INLINE void operator()(CX& a0, CX& a1) const
+	{
+		CX x0 = a0;
+		a0 = cx_fma(x0, m00, cx_mul(a1, m01));
+		a1 = cx_fma(x0, m10, cx_mul(a1, m11));
+	}
+};
+
+// Real 2x2 matrix: half the multiplies of MatOp
+struct RealMatOp
+{
+	REAL m00, m01, m10, m11;
+	RealMatOp(const Matrix2cf& mat) :
+		m00(mat(0, 0).real()), m01(mat(0, 1).real()), 
+		m10(mat(1, 0).real()), m11(mat(1, 1).real()) { }
+	INLINE void operator()(CX& a0, CX& a1) const
+	{
+		CX x0 = a0;
+		a0 = cx_fma(m00, x0, cx_mul(m01, a1));
+		a1 = cx_fma(m10, x0, cx_mul(m11, a1));
+	}
+};
+
+// diag(d0, d1)
+struct DiagOp
+{
+	CX d0, d1;
+	DiagOp(const Matrix2cf& mat) : d0(mat(0, 0)), d1(mat(1, 1)) { }
+	INLINE void operator()(CX& a0, CX& a1) const
+	{
+		a0 = cx_mul(a0, d0);
+		a1 = cx_mul(a1, d1);
+	}
+};
+
+// [0 p01; p10 0]: a permutation with phases
+struct AntiDiagOp
+{
+	CX p01, p10;
+	AntiDiagOp(const Matrix2cf& mat) : p01(mat(0, 1)), p10(mat(1, 0)) { }
+	INLINE void operator()(CX& a0, CX& a1) const
+	{
+		CX x0 = a0;
+		a0 = cx_mul(p01, a1);
+		a1 = cx_mul(p10, x0);
+	}
+};
+
+// Pauli X: flip the pair
+struct SwapOp
+{
+	INLINE void operator()(CX& a0, CX& a1) const { std::swap(a0, a1); }
+};
+
+// diag(1, s)
+template<typename FloatType> // plain float or CX
+struct ScaleOp
+{
+	FloatType s;
+	ScaleOp(const FloatType& s) : s(s) { }
+	INLINE void operator()(CX&, CX& a1) const { a1 = cx_mul(a1, s); }
+};
+
+// Target at bit P, compile-time block size
+template<int P, typename Op>
+MULTI_ISA void pair_kernel(vector<CX>& amp, qubase blockFree, qubase ctrlOn, qubase, const Op& op)
+{
+	const int half = 1 << P;
+	MASKED_ITER(blk, blockFree, ctrlOn)
 	{
-		qubase base1 = base0 ^ t;
-		CX a0 = amp[base0];
-		CX a1 = amp[base1];
-		amp[base0] = a0 * mat(0, 0) + a1 * mat(0, 1);
-		amp[base1] = a0 * mat(1, 0) + a1 * mat(1, 1);
+		CX *a = &amp[blk];
+		for (int j = 0; j < half; ++j)
+			op(a[j], a[j + half]);
+	}
+}
+
+// Target at bit 6 or above: runtime block size, inner loop still contiguous
+template<typename Op>
+MULTI_ISA void pair_kernel_stride(vector<CX>& amp, qubase blockFree, qubase ctrlOn, qubase half, const Op& op)
+{
+	MASKED_ITER(blk, blockFree, ctrlOn)
+	{
+		CX *a = &amp[blk];
+		for (qubase j = 0; j < half; ++j)
+			op(a[j], a[j + half]);
+	}
+}
+
+/*
+ * Apply op to every pair whose control bits (ctrlMask) equal ctrlOn
+ * Dispatches on the target stride. Controls below the target bit break
+ * the blocks apart, so those fall back to enumerating the pairs one by one
+ */
+template<typename Op>
+INLINE void apply_pairs(Q, int tar, qubase ctrlMask, qubase ctrlOn, const Op& op)
+{
+	typedef void (*PairKernel)(vector<CX>&, qubase, qubase, qubase, const Op&);
+	static const PairKernel table[] = {
+		pair_kernel<0, Op>, pair_kernel<1, Op>, pair_kernel<2, Op>,
+		pair_kernel<3, Op>, pair_kernel<4, Op>, pair_kernel<5, Op>,
+		pair_kernel_stride<Op>
+	};
+
+	auto& amp = q.amp;
+	qubase t = q.to_qubase(tar);
+	qubase blockMask = (t << 1) - 1;
+	if (ctrlMask & blockMask)
+	{
+		qubase freeMask = q.full_mask() & ~(ctrlMask | t);
+		MASKED_ITER(base, freeMask, ctrlOn)
+			op(amp[base], amp[base | t]);
+	}
+	else
+		table[min(q.nqubit - 1 - tar, 6)](
+			amp, q.full_mask() & ~(ctrlMask | blockMask), ctrlOn, t, op);
+}
+
+/*
+ * Structure of a 2x2 matrix, detected on entry so that user-supplied 
+ * matrices hit the same fast paths as pauli_X and pauli_Z
+ */
+enum MatKind { MAT_GENERAL, MAT_REAL, MAT_DIAGONAL, MAT_ANTI_DIAGONAL };
+
+INLINE MatKind classify(const Matrix2cf& mat)
+{
+	const CX zero(0);
+	if (mat(0, 1) == zero && mat(1, 0) == zero)
+		return MAT_DIAGONAL;
+	if (mat(0, 0) == zero && mat(1, 1) == zero)
+		return MAT_ANTI_DIAGONAL;
+	if (mat(0, 0).imag() == 0 && mat(0, 1).imag() == 0 &&
+		mat(1, 0).imag() == 0 && mat(1, 1).imag() == 0)
+		return MAT_REAL;
+	return MAT_GENERAL;
+}
+
+// Helper: apply_pairs() with the Op matching the structure of mat
+INLINE void apply_pairs_2x2(Q, int tar, qubase ctrlMask, qubase ctrlOn, const Matrix2cf& mat)
+{
+	switch (classify(mat))
+	{
+	case MAT_DIAGONAL:
+		if (mat(0, 0) == CX(1))
+			apply_pairs(q, tar, ctrlMask, ctrlOn, ScaleOp<CX>(mat(1, 1)));
+		else
+			apply_pairs(q, tar, ctrlMask, ctrlOn, DiagOp(mat));
+		break;
+	case MAT_ANTI_DIAGONAL:
+		if (mat(0, 1) == CX(1) && mat(1, 0) == CX(1))
+			apply_pairs(q, tar, ctrlMask, ctrlOn, SwapOp());
+		else
+			apply_pairs(q, tar, ctrlMask, ctrlOn, AntiDiagOp(mat));
+		break;
+	case MAT_REAL:
+		apply_pairs(q, tar, ctrlMask, ctrlOn, RealMatOp(mat));
+		break;
+	default:
+		apply_pairs(q, tar, ctrlMask, ctrlOn, MatOp(mat));
 	}
 }
 
@@ -40,13 +201,14 @@ INLINE void generic_sparse_update(
 		if (counterpart)
 		{
 			a1 = q[base1];
-			q[base0] = a0 * mat(0, 0) + a1 * mat(0, 1);
-			q[base1] = a0 * mat(1, 0) + a1 * mat(1, 1);
+			q[base0] = cx_fma(a0, mat(0, 0), cx_mul(a1, mat(0, 1)));
+			q[base1] = cx_fma(a0, mat(1, 0), cx_mul(a1, mat(1, 1)));
 		}
-		else // amp of base1 is 0 and we have to add new base
+		else // amp of base1 is 0 and we might have to add new base
 		{
-			q[base0] = a0 * mat(0, 0);
-			q.add_base(base1, a0 * mat(1, 0));
+			q[base0] = cx_mul(a0, mat(0, 0));
+			if (mat(1, 0) != CX(0))
+				q.add_base(base1, cx_mul(a0, mat(1, 0)));
 		}
 	}
 	// Otherwise base0 is target 1 and base1 is target 0
@@ -55,8 +217,57 @@ INLINE void generic_sparse_update(
 	{
 		a1 = q[base0];
 		// a0 == 0
-		q.add_base(base1, a1 * mat(0, 1));
-		q[base0] = a1 * mat(1, 1);
+		if (mat(0, 1) != CX(0))
+			q.add_base(base1, cx_mul(a1, mat(0, 1)));
+		q[base0] = cx_mul(a1, mat(1, 1));
+	}
+}
+
+// Helper for anti-diagonal matrices: cnot_sparse_update with phases
+INLINE void anti_diag_sparse_update(Q, qubase base, qubase t, const Matrix2cf& mat)
+{
+	qubase base1 = base ^ t;
+	if (q.contains_base(base1))
+	{
+		/* process the pair once, from its target 0 side */
+		if (!(base & t))
+		{
+			CX a0 = q[base];
+			q[base] = cx_mul(mat(0, 1), q[base1]);
+			q[base1] = cx_mul(mat(1, 0), a0);
+		}
+	}
+	else // the amplitude moves across: relabel its entry, no zero left behind
+	{
+		q[base] = cx_mul(base & t ? mat(0, 1) : mat(1, 0), q[base]);
+		q.relabel_base(base, base1);
+	}
+}
+
+/*
+ * Helper: sparse update with the kernel matching the structure of mat
+ * Only bases with (base & ctrlMask) == ctrlOn are processed
+ * Diagonal matrices never add a base
+ */
+INLINE void sparse_update_2x2(Q, qubase t, qubase ctrlMask, qubase ctrlOn, const Matrix2cf& mat)
+{
+	switch (classify(mat))
+	{
+	case MAT_DIAGONAL:
+		for (qubase base : q.base_iter_s())
+			if ((base & ctrlMask) == ctrlOn)
+				q[base] = cx_mul(q[base], base & t ? mat(1, 1) : mat(0, 0));
+		break;
+	case MAT_ANTI_DIAGONAL:
+		// Add new states to the end, if any
+		for (qubase base : q.base_iter_s())
+			if ((base & ctrlMask) == ctrlOn)
+				anti_diag_sparse_update(q, base, t, mat);
+		break;
+	default:
+		for (qubase base : q.base_iter_s())
+			if ((base & ctrlMask) == ctrlOn)
+				generic_sparse_update(q, base, t, mat);
 	}
 }
 
@@ -79,18 +290,12 @@ INLINE void cnot_sparse_update(Q, qubase& base, qubase& t)
 
 void Qugate::generic_gate(Q, const Matrix2cf& mat, int tar)
 {
+	q.settle();
 	qubase t = q.to_qubase(tar);
 	if (q.dense)
-	{
-		auto& amp = q.amp;
-		DENSE_ITER(base0)
-			// only process base with 0 at the given target
-			generic_dense_update(amp, base0, t, mat);
-	}
+		apply_pairs_2x2(q, tar, 0, 0, mat);
 	else // sparse
-		// Add new states to the end, if any
-		for (qubase base0 : q.base_iter_s())
-			generic_sparse_update(q, base0, t, mat);
+		sparse_update_2x2(q, t, 0, 0, mat);
 }
 
 void Qugate::hadamard(Q, int tar)
@@ -115,15 +320,10 @@ void Qugate::hadamard_top(Q, int topSize)
  */
 void Qugate::pauli_X(Q, int tar)
 {
+	q.settle();
 	qubase t = q.to_qubase(tar);
 	if (q.dense)
-	{
-		auto& amp = q.amp;
-		DENSE_ITER(base0)
-			// only process base with 0 at the given target
-			if (!(base0 & t))
-				std::swap(amp[base0], amp[base0 ^ t]);
-	}
+		apply_pairs(q, tar, 0, 0, SwapOp());
 	else // sparse
 		// Add new states to the end, if any
 	for (qubase base0 : q.base_iter_s())
@@ -148,12 +348,12 @@ INLINE void bit1_scale_sparse_update(Q, qubase& base0, qubase& t, const FloatTyp
 	if (q.contains_base(base1))
 	{
 		if (!(base0 & t))
-			q[base1] *= s;
+			q[base1] = cx_mul(q[base1], s);
 	}
 	else
 	{
 		if (base0 & t)
-			q[base0] *= s;
+			q[base0] = cx_mul(q[base0], s);
 	}
 }
 
@@ -161,15 +361,10 @@ INLINE void bit1_scale_sparse_update(Q, qubase& base0, qubase& t, const FloatTyp
 template<typename FloatType> // plain float or CX
 INLINE void bit1_scale(Q, int tar, const FloatType& s)
 {
+	q.settle();
 	qubase t = q.to_qubase(tar);
 	if (q.dense)
-	{
-		auto& amp = q.amp;
-		DENSE_ITER(base0)
-			// only process base with 0 at the given target
-			if (!(base0 & t))
-				amp[base0 ^ t] *= s;
-	}
+		apply_pairs(q, tar, 0, 0, ScaleOp<FloatType>(s));
 	else // sparse
 		// Add new states to the end, if any
 	for (qubase base0 : q.base_iter_s())
@@ -203,154 +398,277 @@ void Qugate::rot_Z(Q, float theta, int tar)
 
 void Qugate::phase_scale(Q, float theta, int tar)
 {
+	q.settle();
 	const CX phase = expi(theta);
 	qubase t = q.to_qubase(tar);
 	if (q.dense)
 	{
 		auto& amp = q.amp;
 		DENSE_ITER(base0)
-			amp[base0] *= phase;
+			amp[base0] = cx_mul(amp[base0], phase);
 	}
 	else // sparse
 		for (qubase base0 : q.base_iter_s())
-			q[base0] *= phase;
+			q[base0] = cx_mul(q[base0], phase);
 }
 
 /**********************************************/
 /*********** Multi-qubit gates  ***********/
 /**********************************************/
-void Qugate::generic_gate(Q, const Matrix4cf& mat, int tar1, int tar2)
+// Number of target groups gathered into one GEMM tile
+#define GATE_TILE 64
+
+/*
+ * Helper for generic_gate: gather GATE_TILE groups of 2^k amplitudes 
+ * into the columns of a tile, multiply them all with one GEMM
+ * and scatter the results back through the offset table
+ */
+template<typename MatType, typename TileType>
+MULTI_ISA void tiled_dense_gate(Q, const MatType& mat, const qubase* offsets, qubase tarMask)
 {
-	qubase t1 = q.to_qubase(tar1);
-	qubase t2 = q.to_qubase(tar2);
-	Vector4cf a, newa;
-	vector<qubase> basis(4);
-	if (q.dense)
+	auto& amp = q.amp;
+	const int N = mat.rows();
+	TileType tile(N, GATE_TILE), newTile(N, GATE_TILE);
+	qubase roots[GATE_TILE];
+	int B = 0; // groups in the current tile
+
+	auto flush = [&]()
 	{
-		auto& amp = q.amp;
-		DENSE_ITER(base0)
-			// only process base with 00 at the given targets
-			if (!(base0 & t1) && !(base0 & t2))
-			{
-				basis[0] = base0;
-				basis[1] = base0 ^ t2;
-				basis[2] = base0 ^ t1;
-				basis[3] = base0 ^ (t1 | t2);
-				for (int i = 0; i < 4; ++i)
-					a(i) = amp[basis[i]];
-				newa = mat * a;
-				for (int i = 0; i < 4; ++i)
-					amp[basis[i]] = newa(i);
-			}
+		if (B == GATE_TILE)
+			newTile.noalias() = mat * tile;
+		else
+			newTile.leftCols(B).noalias() = mat * tile.leftCols(B);
+		for (int j = 0; j < B; ++j)
+			for (int i = 0; i < N; ++i)
+				amp[roots[j] | offsets[i]] = newTile(i, j);
+		B = 0;
+	};
+
+	// only process base with 00 at the given targets
+	qubase freeMask = q.full_mask() & ~tarMask;
+	MASKED_ITER(base0, freeMask, 0)
+	{
+		roots[B] = base0;
+		for (int i = 0; i < N; ++i)
+			tile(i, B) = amp[base0 | offsets[i]];
+		if (++B == GATE_TILE)
+			flush();
 	}
-	else // sparse
-		// Not-so-efficient implementation: pretend to be dense
-	DENSE_ITER(base0)
-		if (!(base0 & t1) && !(base0 & t2))
+	if (B > 0)
+		flush();
+}
+
+/*
+ * Helper for generic_gate: sparse version of the k-qubit gate
+ * Not-so-efficient implementation: pretend to be dense
+ */
+template<typename MatType, typename VecType>
+INLINE void sparse_gate(Q, const MatType& mat, const qubase* offsets, qubase tarMask)
+{
+	const int N = mat.rows();
+	VecType a(N), newa(N);
+	qubase freeMask = q.full_mask() & ~tarMask;
+	MASKED_ITER(base0, freeMask, 0)
+	{
+		for (int i = 0; i < N; ++i)
 		{
-			basis[0] = base0;
-			basis[1] = base0 ^ t2;
-			basis[2] = base0 ^ t1;
-			basis[3] = base0 ^ (t1 | t2);
-			for (int i = 0; i < 4 ; ++i)
+			qubase base = base0 | offsets[i];
+			// if any of them doesn't exist, add
+			if (!q.contains_base(base))
 			{
-				qubase base = basis[i];
-				// if any of them doesn't exist, add
-				if (!q.contains_base(base))
-				{
-					q.add_base(base, CX(0));
-					a(i) = CX(0);
-				}
-				else
-					a(i) = q[base];
+				q.add_base(base, CX(0));
+				a(i) = CX(0);
 			}
-			newa = mat * a;
-			for (int i = 0; i < 4; ++i)
-				q[basis[i]] = newa(i);
+			else
+				a(i) = q[base];
 		}
+		newa.noalias() = mat * a;
+		for (int i = 0; i < N; ++i)
+			q[base0 | offsets[i]] = newa(i);
+	}
 }
 
-// Helper: get a vector of shifted qubase
-INLINE vector<qubase> to_qubasis(Q, vector<int>& tars)
+/*
+ * Helper for generic_gate: the fixed-size kernel on K targets read from an array,
+ * so that the fixed-arity overloads don't build a vector per call
+ */
+template<int K>
+INLINE void fixed_gate(Q, const Matrix<CX, 1 << K, 1 << K>& mat, const int* tars)
 {
-	vector<qubase> basis;
-	basis.reserve(tars.size());
-	for (int tar : tars)
-		basis.push_back(q.to_qubase(tar));
-	return basis;
+	q.settle();
+	const int N = 1 << K;
+
+	// same as flip_offsets(), but the loops have compile-time trip counts
+	qubase offsets[N];
+	offsets[0] = 0;
+	for (int b = 0; b < K; ++b)
+	{
+		qubase t = q.to_qubase(tars[K - b - 1]);
+		for (int i = 1 << b; i < 2 << b; ++i)
+			offsets[i] = offsets[i - (1 << b)] | t;
+	}
+	qubase tarMask = offsets[N - 1];
+
+	if (q.dense)
+		tiled_dense_gate<Matrix<CX, N, N>, Matrix<CX, N, GATE_TILE>>(q, mat, offsets, tarMask);
+	else // sparse
+		sparse_gate<Matrix<CX, N, N>, Matrix<CX, N, 1>>(q, mat, offsets, tarMask);
 }
 
-// Helper for generic_gate: is the bits of 'base' at 'tar' positions all zero?
-INLINE bool is_tar_all_zero(qubase& base, vector<qubase>& tarBasis)
+template<int K>
+void Qugate::generic_gate(Q, const Matrix<CX, 1 << K, 1 << K>& mat, const vector<int>& tars)
 {
-	for (qubase& tar : tarBasis)
-		if (base & tar) 
-			return false;
-	return true;
+	if (tars.size() != K)
+		throw QuantumException(
+			"Unitary matrix must have row/col width 2^(number of target bits)");
+	fixed_gate<K>(q, mat, &tars[0]);
 }
 
-// Helper for generic_gate: bit positions of an int decides which target bits to flip
-// fill out 'basis' parameter
-INLINE void flipped_basis(vector<qubase>& basis, qubase& base0, vector<qubase>& tarBasis)
+// One target: the structure-aware single-qubit kernels beat the 2x2 product
+template<>
+void Qugate::generic_gate<1>(Q, const Matrix2cf& mat, const vector<int>& tars)
 {
-	// basis.size() is 2^n, where n = tarBasis.size()
-	const int n = tarBasis.size();
-	for (size_t i = 0; i < basis.size(); ++i)
-	{
-		qubase base = base0;
-		for (int b = 0; b < n ; ++b)
-			if (i & (1 << b))
-				base ^= tarBasis[n-b-1]; // Most significant bit 
-		basis[i] = base;
-	}
+	if (tars.size() != 1)
+		throw QuantumException(
+			"Unitary matrix must have row/col width 2^(number of target bits)");
+	generic_gate(q, mat, tars[0]);
 }
 
-void Qugate::generic_gate(Q, const MatrixXcf& mat, vector<int>& tars)
+// Instantiate the fixed-size kernels
+template void Qugate::generic_gate<2>(Q, const Matrix<CX, 4, 4>&, const vector<int>&);
+template void Qugate::generic_gate<3>(Q, const Matrix<CX, 8, 8>&, const vector<int>&);
+template void Qugate::generic_gate<4>(Q, const Matrix<CX, 16, 16>&, const vector<int>&);
+template void Qugate::generic_gate<5>(Q, const Matrix<CX, 32, 32>&, const vector<int>&);
+
+void Qugate::generic_gate(Q, const Matrix4cf& mat, int tar1, int tar2)
 {
+	const int tars[2] = { tar1, tar2 };
+	fixed_gate<2>(q, mat, tars);
+}
+
+void Qugate::generic_gate(Q, const MatrixXcf& mat, const vector<int>& tars)
+{
+	q.settle();
 	if (mat.rows() != 1 << tars.size())
 		throw QuantumException(
 			"Unitary matrix must have row/col width 2^(number of target bits)");
 
+	// Dispatch to the fixed-size kernels
+	switch (tars.size())
+	{
+	case 1: generic_gate(q, Matrix2cf(mat), tars[0]); return;
+	case 2: generic_gate<2>(q, mat, tars); return;
+	case 3: generic_gate<3>(q, mat, tars); return;
+	case 4: generic_gate<4>(q, mat, tars); return;
+	case 5: generic_gate<5>(q, mat, tars); return;
+	}
+
 	int N = mat.rows();
-	vector<qubase> tarBasis = to_qubasis(q, tars);
-	VectorXcf a(N), newa(N);
-	vector<qubase> basis(N);
+	vector<qubase> offsets = flip_offsets(q, tars);
+	qubase tarMask = offsets[N - 1];
+	if (q.dense)
+		tiled_dense_gate<MatrixXcf, MatrixXcf>(q, mat, &offsets[0], tarMask);
+	else // sparse
+		sparse_gate<MatrixXcf, VectorXcf>(q, mat, &offsets[0], tarMask);
+}
+
+void Qugate::generic_gate(Q, const SparseMatrix<CX>& mat, const vector<int>& tars)
+{
+	q.settle();
+	const int N = mat.rows();
+	if (N != 1 << tars.size() || mat.cols() != N)
+		throw QuantumException(
+			"Unitary matrix must have row/col width 2^(number of target bits)");
+
+	// Keep only the rows that differ from identity, in CSR form over 
+	// the compacted list of columns they read
+	SparseMatrix<CX, RowMajor> rowMat = mat;
+	vector<int> rows, cols, colSlot, rowStart(1, 0);
+	vector<int> slotOf(N, -1);
+	vector<CX> vals;
+	for (int r = 0; r < N; ++r)
+	{
+		int nnz = 0;
+		bool identity = true;
+		for (SparseMatrix<CX, RowMajor>::InnerIterator it(rowMat, r); it; ++it)
+			if (it.value() != CX(0))
+			{
+				++nnz;
+				identity &= it.col() == r && it.value() == CX(1);
+			}
+		if (identity && nnz == 1)
+			continue;
+
+		rows.push_back(r);
+		for (SparseMatrix<CX, RowMajor>::InnerIterator it(rowMat, r); it; ++it)
+			if (it.value() != CX(0))
+			{
+				int c = it.col();
+				if (slotOf[c] < 0)
+				{
+					slotOf[c] = cols.size();
+					cols.push_back(c);
+				}
+				colSlot.push_back(slotOf[c]);
+				vals.push_back(it.value());
+			}
+		rowStart.push_back(vals.size());
+	}
+	if (rows.empty())
+		return;
+
+	vector<qubase> offsets = flip_offsets(q, tars);
+	qubase tarMask = offsets[N - 1];
+	vector<CX> a(cols.size()), newa(rows.size());
+	// new amplitudes of the active rows in one group
+	auto multiply = [&]()
+	{
+		for (size_t i = 0; i < rows.size(); ++i)
+		{
+			CX sum = 0;
+			for (int k = rowStart[i]; k < rowStart[i + 1]; ++k)
+				sum = cx_fma(vals[k], a[colSlot[k]], sum);
+			newa[i] = sum;
+		}
+	};
+
 	if (q.dense)
 	{
 		auto& amp = q.amp;
-		DENSE_ITER(base0)
-			// only process base with 00 at the given targets
-		if (is_tar_all_zero(base0, tarBasis))
+		qubase freeMask = q.full_mask() & ~tarMask;
+		MASKED_ITER(base0, freeMask, 0)
 		{
-			flipped_basis(basis, base0, tarBasis);
-			for (int i = 0; i < N; ++i)
-				a(i) = amp[basis[i]];
-			newa = mat * a;
-			for (int i = 0; i < N; ++i)
-				amp[basis[i]] = newa(i);
+			for (size_t j = 0; j < cols.size(); ++j)
+				a[j] = amp[base0 | offsets[cols[j]]];
+			multiply();
+			for (size_t i = 0; i < rows.size(); ++i)
+				amp[base0 | offsets[rows[i]]] = newa[i];
 		}
 	}
 	else // sparse
-		// Not-so-efficient implementation: pretend to be dense
-	DENSE_ITER(base0)
-	if (is_tar_all_zero(base0, tarBasis))
 	{
-		flipped_basis(basis, base0, tarBasis);
-		for (int i = 0; i < N; ++i)
+		// process each group once, from whichever member we meet first
+		unordered_set<qubase> visited;
+		size_t oldSize = q.size(); // don't visit the bases we add
+		for (size_t bi = 0; bi < oldSize; ++bi)
 		{
-			qubase base = basis[i];
-			// if any of them doesn't exist, add
-			if (!q.contains_base(base))
+			qubase base0 = q.get_base_internal(bi) & ~tarMask;
+			if (contains(visited, base0))
+				continue;
+			visited.insert(base0);
+			for (size_t j = 0; j < cols.size(); ++j)
+				a[j] = q.get_amp(base0 | offsets[cols[j]]);
+			multiply();
+			for (size_t i = 0; i < rows.size(); ++i)
 			{
-				q.add_base(base, CX(0));
-				a(i) = CX(0);
+				qubase base = base0 | offsets[rows[i]];
+				if (q.contains_base(base))
+					q[base] = newa[i];
+				// don't fill the register with zeros
+				else if (cx_norm(newa[i]) > TOL)
+					q.add_base(base, newa[i]);
 			}
-			else
-				a(i) = q[base];
 		}
-		newa = mat * a;
-		for (int i = 0; i < N; ++i)
-			q[basis[i]] = newa(i);
 	}
 }
 
@@ -359,15 +677,11 @@ void Qugate::generic_gate(Q, const MatrixXcf& mat, vector<int>& tars)
 /**********************************************/
 void Qugate::cnot(Q, int ctrl, int tar)
 {
+	q.settle();
 	qubase c = q.to_qubase(ctrl);
 	qubase t = q.to_qubase(tar);
 	if (q.dense)
-	{
-		auto& amp = q.amp;
-		DENSE_ITER(base)
-			if ((base & c) && (base & t)) // base & t: don't flip (swap)  twice
-				std::swap(amp[base ^ t], amp[base]);
-	}
+		apply_pairs(q, tar, c, c, SwapOp());
 	else // sparse
 		// Add new states to the end, if any
 		for (qubase base : q.base_iter_s())
@@ -377,34 +691,23 @@ void Qugate::cnot(Q, int ctrl, int tar)
 
 void Qugate::generic_control(Q, const Matrix2cf& mat, int ctrl, int tar)
 {
+	q.settle();
 	qubase c = q.to_qubase(ctrl);
 	qubase t = q.to_qubase(tar);
 	if (q.dense)
-	{
-		auto& amp = q.amp;
-		DENSE_ITER(base)
-			if (base & c) // base & t: don't flip (swap)  twice
-				generic_dense_update(amp, base, t, mat);
-	}
+		apply_pairs_2x2(q, tar, c, c, mat);
 	else // sparse
-		// Add new states to the end, if any
-		for (qubase base : q.base_iter_s())
-			if (base & c)
-				generic_sparse_update(q, base, t, mat);
+		sparse_update_2x2(q, t, c, c, mat);
 }
 
 void Qugate::toffoli(Q, int ctrl1, int ctrl2, int tar)
 {
+	q.settle();
 	qubase c1 = q.to_qubase(ctrl1);
 	qubase c2 = q.to_qubase(ctrl2);
 	qubase t = q.to_qubase(tar);
 	if (q.dense)
-	{
-		auto& amp = q.amp;
-		DENSE_ITER(base)
-		if ((base & c1) && (base & c2) && (base & t)) // base & t: don't flip (swap)  twice
-			std::swap(amp[base ^ t], amp[base]);
-	}
+		apply_pairs(q, tar, c1 | c2, c1 | c2, SwapOp());
 	else // sparse
 		// Add new states to the end, if any
 		for (qubase base : q.base_iter_s())
@@ -414,21 +717,14 @@ void Qugate::toffoli(Q, int ctrl1, int ctrl2, int tar)
 
 void Qugate::generic_toffoli(Q, const Matrix2cf& mat, int ctrl1, int ctrl2, int tar)
 {
+	q.settle();
 	qubase c1 = q.to_qubase(ctrl1);
 	qubase c2 = q.to_qubase(ctrl2);
 	qubase t = q.to_qubase(tar);
 	if (q.dense)
-	{
-		auto& amp = q.amp;
-		DENSE_ITER(base)
-		if ((base & c1) && (base & c2)) // base & t: don't flip (swap)  twice
-			generic_dense_update(amp, base, t, mat);
-	}
+		apply_pairs_2x2(q, tar, c1 | c2, c1 | c2, mat);
 	else // sparse
-		// Add new states to the end, if any
-		for (qubase base : q.base_iter_s())
-			if ((base & c1) && (base & c2))
-				generic_sparse_update(q, base, t, mat);
+		sparse_update_2x2(q, t, c1 | c2, c1 | c2, mat);
 }
 
 // Helper: are the control bits on?
@@ -442,55 +738,106 @@ INLINE bool is_ctrl_on(qubase base, vector<qubase>& ctrlBasis)
 
 void Qugate::ncnot(Q, vector<int>& ctrls, int tar)
 {
-	vector<qubase> ctrlBasis;
-	ctrlBasis.reserve(ctrls.size());
-	for (int ctrl : ctrls)
-		ctrlBasis.push_back(q.to_qubase(ctrl));
+	q.settle();
 	qubase t = q.to_qubase(tar);
 	if (q.dense)
 	{
-		auto& amp = q.amp;
-		DENSE_ITER(base)
-			if (is_ctrl_on(base, ctrlBasis) && (base & t))
-				std::swap(amp[base ^ t], amp[base]);
+		// 2^(n-c-1) pairs with all ctrls 1
+		qubase ctrlMask = to_mask(q, ctrls);
+		apply_pairs(q, tar, ctrlMask, ctrlMask, SwapOp());
 	}
 	else // sparse
+	{
+		vector<qubase> ctrlBasis = to_qubasis(q, ctrls);
 		// Add new states to the end, if any
 		for (qubase base : q.base_iter_s())
 			if (is_ctrl_on(base, ctrlBasis))
 				cnot_sparse_update(q, base, t);
+	}
 }
 
 void Qugate::generic_ncontrol(Q, const Matrix2cf& mat, vector<int>& ctrls, int tar)
 {
-	vector<qubase> ctrlBasis = to_qubasis(q, ctrls);
+	q.settle();
 	qubase t = q.to_qubase(tar);
+	qubase ctrlMask = to_mask(q, ctrls);
+	if (q.dense)
+		apply_pairs_2x2(q, tar, ctrlMask, ctrlMask, mat);
+	else // sparse
+		sparse_update_2x2(q, t, ctrlMask, ctrlMask, mat);
+}
+
+void Qugate::apply_controlled(Q, const MatrixXcf& mat,
+	const vector<int>& ctrls, const vector<int>& ctrlValues, const vector<int>& tars)
+{
+	q.settle();
+	if (mat.rows() != 1 << tars.size())
+		throw QuantumException(
+			"Unitary matrix must have row/col width 2^(number of target bits)");
+
+	qubase tarMask = to_mask(q, tars);
+	auto masks = control_masks(q, ctrls, ctrlValues, tarMask);
+	qubase ctrlMask = masks.first, ctrlOn = masks.second;
+
+	if (q.dense && tars.size() == 1)
+	{
+		apply_pairs_2x2(q, tars[0], ctrlMask, ctrlOn, mat);
+		return;
+	}
+
+	const int N = mat.rows();
+	vector<qubase> offsets = flip_offsets(q, tars);
+	VectorXcf a(N), newa(N);
 	if (q.dense)
 	{
 		auto& amp = q.amp;
-		DENSE_ITER(base)
-			if (is_ctrl_on(base, ctrlBasis))
-				generic_dense_update(amp, base, t, mat);
+		// only the subspace where the controls fire
+		qubase freeMask = q.full_mask() & ~(ctrlMask | tarMask);
+		MASKED_ITER(base0, freeMask, ctrlOn)
+		{
+			for (int i = 0; i < N; ++i)
+				a(i) = amp[base0 | offsets[i]];
+			newa.noalias() = mat * a;
+			for (int i = 0; i < N; ++i)
+				amp[base0 | offsets[i]] = newa(i);
+		}
 	}
 	else // sparse
-		// Add new states to the end, if any
-		for (qubase base : q.base_iter_s())
-			if (is_ctrl_on(base, ctrlBasis))
-				generic_sparse_update(q, base, t, mat);
+	{
+		// process each group of 2^k bases once, from whichever member we meet first
+		unordered_set<qubase> visited;
+		size_t oldSize = q.size(); // don't visit the bases we add
+		for (size_t bi = 0; bi < oldSize; ++bi)
+		{
+			qubase base0 = q.get_base_internal(bi) & ~tarMask;
+			if ((base0 & ctrlMask) != ctrlOn || contains(visited, base0))
+				continue;
+			visited.insert(base0);
+			for (int i = 0; i < N; ++i)
+				a(i) = q.get_amp(base0 | offsets[i]);
+			newa.noalias() = mat * a;
+			for (int i = 0; i < N; ++i)
+			{
+				qubase base = base0 | offsets[i];
+				if (q.contains_base(base))
+					q[base] = newa(i);
+				// don't fill the register with zeros
+				else if (cx_norm(newa(i)) > TOL)
+					q.add_base(base, newa(i));
+			}
+		}
+	}
 }
 
 void Qugate::control_phase_shift(Q, float theta, int ctrl, int tar)
 {
+	q.settle();
 	const CX phase = expi(theta);
 	qubase c = q.to_qubase(ctrl);
 	qubase t = q.to_qubase(tar);
 	if (q.dense)
-	{
-		auto& amp = q.amp;
-		DENSE_ITER(base)
-		if ((base & c) && !(base & t)) // base & t: don't flip (swap)  twice
-			amp[base ^ t] *= phase;
-	}
+		// scale only the bases with ctrl 1 and target 1
+		apply_pairs(q, tar, c, c, ScaleOp<CX>(phase));
 	else // sparse
 		// Add new states to the end, if any
 	for (qubase base : q.base_iter_s())
@@ -526,6 +873,7 @@ INLINE void swap_sparse_update(Q, const qubase& base, const qubase& t1, const qu
 
 void Qugate::swap(Q, int tar1, int tar2)
 {
+	q.settle();
 	qubase t1 = q.to_qubase(tar1);
 	qubase t2 = q.to_qubase(tar2);
 	if (q.dense)
@@ -544,15 +892,16 @@ void Qugate::swap(Q, int tar1, int tar2)
 
 void Qugate::cswap(Q, int ctrl, int tar1, int tar2)
 {
+	q.settle();
 	qubase t1 = q.to_qubase(tar1);
 	qubase t2 = q.to_qubase(tar2);
 	qubase c = q.to_qubase(ctrl);
 	if (q.dense)
 	{
 		auto& amp = q.amp;
-		DENSE_ITER(base0)
-			// only process base with 00 at the given target
-		if (!(base0 & t1) && !(base0 & t2) && (base0 & c))
+		// only process base with ctrl 1 and 00 at the given targets
+		qubase freeMask = q.full_mask() & ~(c | t1 | t2);
+		MASKED_ITER(base0, freeMask, c)
 			std::swap(amp[base0 ^ t1], amp[base0 ^ t2]);
 	}
 	else // sparse
@@ -562,6 +911,64 @@ void Qugate::cswap(Q, int ctrl, int tar1, int tar2)
 			swap_sparse_update(q, base0, t1, t2);
 }
 
+/*
+ * Dense: in place, as a chain of qubit swaps. A cycle of L qubits takes L - 1
+ * swaps, each one full MASKED_ITER sweep over amp[], so up to n - 1 passes.
+ * This is not a single-pass cache-oblivious bit permutation: that one is out
+ * of place and needs a second 2^n vector. Large registers run out of memory
+ * before bandwidth, so we pay in passes instead.
+ * Sparse: every base is relabeled into a new register
+ */
+void Qugate::permute_qubits(Q, const vector<int>& perm)
+{
+	q.settle();
+	const int n = q.nqubit;
+	if (perm.size() != size_t(n))
+		throw QuantumException("Permutation must cover every qubit");
+	// bit b of the old base moves to bit dst[b]
+	vector<int> dst(n);
+	vector<bool> seen(n, false);
+	for (int i = 0; i < n; ++i)
+	{
+		if (perm[i] < 0 || perm[i] >= n || seen[perm[i]])
+			throw QuantumException("Not a valid qubit permutation");
+		seen[perm[i]] = true;
+		dst[n - 1 - i] = n - 1 - perm[i];
+	}
+
+	if (q.dense)
+	{
+		// In place: every cycle of the permutation is a chain of qubit swaps.
+		// pos[i]: where the qubit now at position i has to go
+		auto& amp = q.amp;
+		vector<int> pos(perm);
+		for (int i = 0; i < n; ++i)
+			while (pos[i] != i)
+			{
+				int j = pos[i];
+				qubase t1 = q.to_qubase(i), t2 = q.to_qubase(j);
+				MASKED_ITER(base0, q.full_mask() & ~(t1 | t2), 0)
+					std::swap(amp[base0 | t1], amp[base0 | t2]);
+				// qubit i is home, the one from j waits at i
+				pos[i] = pos[j];
+				pos[j] = j;
+			}
+	}
+	else // sparse
+	{
+		Qureg newq = Qureg::create<false>(n, q.size());
+		for (size_t i = 0; i < q.size(); ++i)
+		{
+			qubase base = q.get_base_internal(i), newBase = 0;
+			for (int b = 0; b < n; ++b)
+				if (base & (qubase(1) << b))
+					newBase |= qubase(1) << dst[b];
+			newq.add_base(newBase, q.amp[i]);
+		}
+		q = std::move(newq);
+	}
+}
+
 ///////************** QFT **************///////
 // recursive QFT subroutine
 void qft_sub(Q, int tarStart, int tarSize)
@@ -587,12 +994,13 @@ void Qugate::qft(Q, int tarStart, int tarSize)
 {
 	qft_sub(q, tarStart, tarSize);
 	for (int tar = tarStart; tar < tarStart + tarSize / 2; ++tar)
-		swap(q, tar, tarStart + tarSize - 1 - tar);
+		swap(q, tar, 2 * tarStart + tarSize - 1 - tar);
 }
 
 ///////************** Grover's **************///////
 void Qugate::grover_diffuse(Q, int tarStart, int tarSize)
 {
+	q.settle();
 	// base mask: only these states won't be inverted
 	qubase mask = 0;
 	for (int tar = tarStart; tar < tarStart + tarSize; ++tar)
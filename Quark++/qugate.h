@@ -10,8 +10,23 @@ namespace Qugate
 	void generic_gate(Q, const Matrix4cf&, int tar1, int tar2);
 	/*
 	 *	Works with arbitrary number of target qubits
+	 * 1 to 5 targets are dispatched to the fixed-size kernels below
 	 */
-	void generic_gate(Q, const MatrixXcf&, vector<int>& tars);
+	void generic_gate(Q, const MatrixXcf&, const vector<int>& tars);
+
+	/*
+	 *	Fixed-size kernel for K = 1..5 target qubits (instantiated in qugate.cpp)
+	 * Stack storage and compile-time unrolled offsets
+	 */
+	template<int K>
+	void generic_gate(Q, const Matrix<CX, 1 << K, 1 << K>&, const vector<int>& tars);
+
+	/*
+	 *	Mostly-identity operators, e.g. toffoli_mat(n).sparseView()
+	 * Only the rows that differ from identity are computed, 
+	 * reading only the amplitudes of the columns they reference
+	 */
+	void generic_gate(Q, const SparseMatrix<CX>&, const vector<int>& tars);
 
 	///////************** Single-qubit gates **************///////
 	void hadamard(Q, int tar);
@@ -39,6 +54,14 @@ namespace Qugate
 	void generic_ncontrol(Q, const Matrix2cf&, vector<int>& ctrls, int tar);
 	void ncnot(Q, vector<int>& ctrls, int tar);
 
+	/*
+	 *	Controlled k-qubit unitary. Works only on the active subspace
+	 * ctrlValues: fire on 1 or 0 for each control qubit. Empty means all 1
+	 * mat: 2^k square matrix over tars, tars[0] the most significant
+	 */
+	void apply_controlled(Q, const MatrixXcf& mat, const vector<int>& ctrls,
+		const vector<int>& ctrlValues, const vector<int>& tars);
+
 	void control_phase_shift(Q, float theta, int ctrl, int tar);
 
 	///////************** Swap gates **************///////
@@ -46,6 +69,14 @@ namespace Qugate
 
 	void cswap(Q, int ctrl, int tar1, int tar2);
 
+	/*
+	 *	Physically reorder the qubits: qubit i moves to position perm[i]
+	 * Dense registers are permuted in place, one swap() per qubit that moves
+	 * minus one per cycle of perm. Each swap is a full pass over the register,
+	 * traded for not allocating a second one (no cache-oblivious single pass)
+	 */
+	void permute_qubits(Q, const vector<int>& perm);
+
 	///////************** Special gates **************///////
 	// tarSize: number of qubits to be operated on
 	void qft(Q, int tarStart, int tarSize);
@@ -0,0 +1,66 @@
+#ifndef qugate_helpers_h__
+#define qugate_helpers_h__
+
+#include "qureg.h"
+
+/*
+ *	Internal helpers shared by the gate kernels (qugate.cpp) 
+ * and the blocked circuit executor (qucircuit.cpp)
+ */
+
+// Helper: get a vector of shifted qubase
+INLINE vector<qubase> to_qubasis(Q, const vector<int>& tars)
+{
+	vector<qubase> basis;
+	basis.reserve(tars.size());
+	for (int tar : tars)
+		basis.push_back(q.to_qubase(tar));
+	return basis;
+}
+
+// Helper: OR of all the shifted qubase
+INLINE qubase to_mask(Q, const vector<int>& tars)
+{
+	qubase mask = 0;
+	for (int tar : tars)
+		mask |= q.to_qubase(tar);
+	return mask;
+}
+
+// Helper: offsets[i] flips the target bits set in i, 
+// tars[0] being the most significant bit
+INLINE vector<qubase> flip_offsets(Q, const vector<int>& tars)
+{
+	const int n = tars.size();
+	vector<qubase> offsets(size_t(1) << n);
+	offsets[0] = 0;
+	for (int b = 0; b < n; ++b)
+	{
+		qubase t = q.to_qubase(tars[n - b - 1]);
+		size_t half = size_t(1) << b;
+		for (size_t i = half; i < half * 2; ++i)
+			offsets[i] = offsets[i - half] | t;
+	}
+	return offsets;
+}
+
+/*
+ *	Helper: (ctrlMask, ctrlOn) of a controlled gate. ctrlOn is the part of 
+ * ctrlMask required to be 1, the rest fires on 0. Empty ctrlValues means all 1
+ */
+INLINE pair<qubase, qubase> control_masks(Q, const vector<int>& ctrls, 
+	const vector<int>& ctrlValues, qubase tarMask)
+{
+	if (!ctrlValues.empty() && ctrlValues.size() != ctrls.size())
+		throw QuantumException("Each control qubit needs a control value");
+	qubase ctrlMask = to_mask(q, ctrls);
+	if (ctrlMask & tarMask)
+		throw QuantumException("Control and target qubits should not overlap");
+	qubase ctrlOn = ctrlMask;
+	for (size_t i = 0; i < ctrlValues.size(); ++i)
+		if (!ctrlValues[i])
+			ctrlOn ^= q.to_qubase(ctrls[i]);
+	return pair<qubase, qubase>(ctrlMask, ctrlOn);
+}
+
+#endif // qugate_helpers_h__
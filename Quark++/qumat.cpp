@@ -8,6 +8,8 @@ using namespace Qumat;
 
 Qureg Qumat::kronecker(Q1, Q2, bool resultDense)
 {
+	q1.settle();
+	q2.settle();
 	int new_nqubit = q1.nqubit + q2.nqubit;
 	size_t size1 = q1.size();
 	size_t size2 = q2.size();
@@ -24,7 +26,7 @@ Qureg Qumat::kronecker(Q1, Q2, bool resultDense)
 		for (int i2 = 0; i2 < size2; ++i2)
 		{
 			qubase newBase = (q1.get_base_internal(i1) << nqubit2) | q2.get_base_internal(i2);
-			CX newAmp = q1.amp[i1] * q2.amp[i2];
+			CX newAmp = cx_mul(q1.amp[i1], q2.amp[i2]);
 			if (resultDense)
 				qans.amp[newBase] = newAmp;
 			else
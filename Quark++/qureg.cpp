@@ -32,9 +32,106 @@ Qureg::Qureg(bool _dense, int _nqubit, qubase initBase, size_t reservedSize, boo
 	}
 }
 
+template<bool isDense, typename AmpOf>
+Qureg Qureg::create_subregister(int nqubit, int startBit, int qsize, qubase initBase, AmpOf ampOf)
+{
+	if (qsize < 0)
+		qsize = nqubit - startBit;
+	const int shift = nqubit - startBit - qsize;
+	const qubase fixed = initBase & ~(((qubase(1) << qsize) - 1) << shift);
+	const int64_t n = int64_t(1) << qsize;
+	Qureg q(isDense, nqubit, fixed, isDense ? 0 : n, false);
+	if (isDense)
+	{
+		OMP_FOR(n)
+		for (int64_t x = 0; x < n; ++x)
+			q.amp[fixed | (qubase(x) << shift)] = ampOf(x);
+	}
+	else // sparse
+	{
+		q.amp.resize(n);
+		q.basis.resize(n);
+		OMP_FOR(n)
+		for (int64_t x = 0; x < n; ++x)
+		{
+			q.basis[x] = fixed | (qubase(x) << shift);
+			q.amp[x] = ampOf(x);
+		}
+		for (int64_t x = 0; x < n; ++x)
+			q.basemap[q.basis[x]] = x;
+	}
+	return q;
+}
+
+template<bool isDense>
+Qureg Qureg::create_uniform(int nqubit, int startBit, int qsize, qubase initBase)
+{
+	if (qsize < 0)
+		qsize = nqubit - startBit;
+	// subregister bits of initBase
+	const qubase init = (initBase >> (nqubit - startBit - qsize)) & ((qubase(1) << qsize) - 1);
+	const float norm = 1 / sqrt(float(qubase(1) << qsize));
+	return create_subregister<isDense>(nqubit, startBit, qsize, initBase,
+		[=](int64_t x) { return CX(bitwise_dot(x, init) ? -norm : norm); });
+}
+
+template<bool isDense>
+Qureg Qureg::create_qft(int nqubit, int startBit, int qsize, qubase initBase)
+{
+	if (qsize < 0)
+		qsize = nqubit - startBit;
+	const qubase subMask = (qubase(1) << qsize) - 1;
+	const qubase init = (initBase >> (nqubit - startBit - qsize)) & subMask;
+	const double norm = 1 / sqrt(double(subMask + 1));
+	// exp(2 PI i init x / 2^qsize), the product taken mod 2^qsize
+	return create_subregister<isDense>(nqubit, startBit, qsize, initBase,
+		[=](int64_t x) { return CX(std::polar(norm, 2 * PI * ((init * x) & subMask) / (subMask + 1))); });
+}
+
+template<bool isDense>
+Qureg Qureg::create_ghz(int nqubit)
+{
+	const qubase ones = (qubase(1) << nqubit) - 1;
+	const float norm = 1 / sqrt(2.0f);
+	Qureg q(isDense, nqubit, 0, 2, false);
+	if (isDense)
+		q.amp[0] = q.amp[ones] = norm;
+	else
+	{
+		q.add_base(0, norm);
+		q.add_base(ones, norm);
+	}
+	return q;
+}
+
+template Qureg Qureg::create_uniform<true>(int, int, int, qubase);
+template Qureg Qureg::create_uniform<false>(int, int, int, qubase);
+template Qureg Qureg::create_qft<true>(int, int, int, qubase);
+template Qureg Qureg::create_qft<false>(int, int, int, qubase);
+template Qureg Qureg::create_ghz<true>(int);
+template Qureg Qureg::create_ghz<false>(int);
+
+// Sort basis[], amp[] and basemap follow
+Qureg& Qureg::sort()
+{
+	settle();
+	if (dense) return *this; // do nothing
+	std::sort(basis.begin(), basis.end());
+	vector<CX> sortedAmp(amp.size());
+	for (size_t i = 0; i < basis.size(); ++i)
+	{
+		size_t& index = basemap[basis[i]];
+		sortedAmp[i] = amp[index];
+		index = i;
+	}
+	amp = move(sortedAmp);
+	return *this;
+}
+
 // Remove near-zero amplitudes
 Qureg& Qureg::purge()
 {
+	settle();
 	if (dense) return *this; // do nothing
 	vector<CX> purgedAmp;
 	purgedAmp.reserve(amp.capacity());
@@ -45,7 +142,7 @@ Qureg& Qureg::purge()
 	for (qubase& base : basis)
 	{
 		a = (*this)[base];
-		if (norm(a) > TOL)
+		if (cx_norm(a) > TOL)
 		{
 			purgedAmp.push_back(a);
 			purgedBasis.push_back(base);
@@ -68,6 +165,9 @@ Qureg Qureg::clone()
 	qc.amp = this->amp;
 	qc.basis = this->basis;
 	qc.basemap = this->basemap;
+	qc.pendingMask = this->pendingMask;
+	qc.pendingValue = this->pendingValue;
+	qc.pendingScale = this->pendingScale;
 	return qc;
 }
 
@@ -80,13 +180,14 @@ Qureg Qureg::clone()
 
 string Qureg::to_string(bool nonZeroOnly)
 {
+	settle();
 	ostringstream oss;
 	oss << setprecision(3) << "Qureg[";
 	size_t actualPrints = 0;
 	for (size_t i = 0; i < size(); ++i)
 	{
 		CX a = dense ? amp[i] : (*this)[basis[i]];
-		float prob = norm(a);
+		float prob = cx_norm(a);
 		if (nonZeroOnly && prob < TOL)
 			continue;
 
@@ -109,6 +210,7 @@ string Qureg::to_string(bool nonZeroOnly)
 
 Qureg& Qureg::operator+=(int scratchQubits)
 {
+	settle();
 	if (dense)
 	{
 		amp.resize(1 << (nqubit + scratchQubits), CX(0));
@@ -135,6 +237,7 @@ Qureg& Qureg::operator+=(int scratchQubits)
 
 Qureg::operator VectorXcf()
 {
+	settle();
 	VectorXcf vec(1 << nqubit);
 	if (dense)
 		for (qubase base = 0; base < 1<<nqubit ; ++base)
@@ -145,59 +248,101 @@ Qureg::operator VectorXcf()
 	return vec;
 }
 
+/*
+ * Helper: collect make(i) for every i in [0, n) with keep(i), in ascending i.
+ * Each block fills its own vector in parallel, then they are joined in order
+ */
+template<typename T, typename Keep, typename Make>
+INLINE vector<T> parallel_collect(int64_t n, Keep keep, Make make)
+{
+	const int64_t nblock = min<int64_t>(256, n / PARALLEL_MIN + 1);
+	vector<vector<T>> parts(nblock);
+	OMP_FOR(n)
+	for (int64_t b = 0; b < nblock; ++b)
+		for (int64_t i = n * b / nblock; i < n * (b + 1) / nblock; ++i)
+			if (keep(i))
+				parts[b].push_back(make(i));
+
+	if (nblock == 1)
+		return std::move(parts[0]);
+	size_t total = 0;
+	for (auto& part : parts) total += part.size();
+	vector<T> all;
+	all.reserve(total);
+	for (auto& part : parts)
+		all.insert(all.end(), part.begin(), part.end());
+	return all;
+}
+
 vector<qubase> Qureg::non_zero_states()
 {
-	vector<qubase> nonZeros;
-	if (dense)
-	{
-		for (qubase base = 0; base < 1 << nqubit; ++base)
-			if (norm(amp[base]) > TOL)
-				nonZeros.push_back(base);
-	}
-	else
-	{
-		for (qubase& base : basis)
-			if (norm((*this)[base]) > TOL)
-				nonZeros.push_back(base);
-	}
-	return nonZeros;
+	return parallel_collect<qubase>(amp.size(),
+		[&](int64_t i) { return prob_internal(i) > TOL; },
+		[&](int64_t i) { return get_base_internal(i); });
 }
 
 vector<pair<qubase, float>> Qureg::sorted_non_zero_states()
+{
+	return top_k_states(0);
+}
+
+vector<pair<qubase, float>> Qureg::top_k_states(size_t k, float cutoff)
 {
 	typedef pair<qubase, float> qentry;
-	auto cmp = [](const qentry& x1, const qentry& x2)
+	auto better = [](const qentry& x1, const qentry& x2)
 	{
 		// if probabiliy same, we sort the basis ascendingly
-		//if (abs(x1.second - x2.second) < TOL)
 		if (x1.second == x2.second)
-			return x1.first > x2.first;
-		return x1.second < x2.second;
+			return x1.first < x2.first;
+		return x1.second > x2.second;
 	};
-	std::priority_queue<qentry, vector<qentry>, decltype(cmp)> que(cmp);
 
-	if (dense)
-		for (qubase base = 0; base < 1 << nqubit; ++base)
+	const int64_t n = amp.size();
+	vector<qentry> top;
+	if (k == 0 || k >= size_t(n))
+		// threshold mode: one filtering pass, only the survivors get sorted
+		top = parallel_collect<qentry>(n,
+			[&](int64_t i) { return prob_internal(i) > cutoff; },
+			[&](int64_t i) { return qentry(get_base_internal(i), prob_internal(i)); });
+	else
+	{
+		// each block keeps a heap of its k best, worst on top
+		const int64_t nblock = min<int64_t>(256, n / PARALLEL_MIN + 1);
+		vector<vector<qentry>> heaps(nblock);
+		OMP_FOR(n)
+		for (int64_t b = 0; b < nblock; ++b)
 		{
-			float prob = norm(amp[base]);
-			if (prob > TOL)
-				que.push(qentry(base, prob));
+			auto& heap = heaps[b];
+			heap.reserve(k);
+			for (int64_t i = n * b / nblock; i < n * (b + 1) / nblock; ++i)
+			{
+				float prob = prob_internal(i);
+				if (prob <= cutoff)
+					continue;
+				qentry entry(get_base_internal(i), prob);
+				if (heap.size() < k)
+				{
+					heap.push_back(entry);
+					std::push_heap(heap.begin(), heap.end(), better);
+				}
+				else if (better(entry, heap.front()))
+				{
+					std::pop_heap(heap.begin(), heap.end(), better);
+					heap.back() = entry;
+					std::push_heap(heap.begin(), heap.end(), better);
+				}
+			}
 		}
-	else
-		for (qubase& base : basis)
+		for (auto& heap : heaps)
+			top.insert(top.end(), heap.begin(), heap.end());
+		if (top.size() > k)
 		{
-			float prob = norm((*this)[base]);
-			if (prob > TOL)
-				que.push(qentry(base, prob));
+			std::nth_element(top.begin(), top.begin() + k, top.end(), better);
+			top.resize(k);
 		}
-	
-	vector<qentry> sortedNonZeros;
-	while (!que.empty())
-	{
-		sortedNonZeros.push_back(que.top());
-		que.pop();
 	}
-	return sortedNonZeros;
+	std::sort(top.begin(), top.end(), better);
+	return top;
 }
 
 float Qureg::prefix_prob(int nbit, qubase prefix)
@@ -210,41 +355,64 @@ float Qureg::prefix_prob(int nbit, qubase prefix)
 
 	float prob = 0;
 	if (dense)
-		for (qubase base = 0; base < 1 << nqubit; ++base)
-		{
-			if ((base & mask) == prefix)
-				prob += norm(amp[base]);
-		}
+	{
+		// bases with the prefix form one contiguous block
+		const int64_t n = int64_t(1) << (nqubit - nbit);
+		OMP_FOR_SUM(prob, n)
+		for (int64_t i = 0; i < n; ++i)
+			prob += prob_internal(prefix + i);
+	}
 	else
-		for (qubase& base : basis)
-		{
-			if ((base & mask) == prefix)
-				prob += norm((*this)[base]);
-		}
+	{
+		const int64_t n = amp.size();
+		OMP_FOR_SUM(prob, n)
+		for (int64_t i = 0; i < n; ++i)
+			if ((basis[i] & mask) == prefix)
+				prob += prob_internal(i);
+	}
 	return prob;
 }
 
 qubase measure(Q)
 {
 	float prob = rand_float();
-	if (q.dense)
-		DENSE_ITER(base)
-		{
-			prob -= norm(q.amp[base]);
-			if (prob <= 0)
-				return base;
-		}
-	else
-		for (qubase& base : q.base_iter_s())
-		{
-			prob -= norm(q[base]);
-			if (prob <= 0)
-				return base;
-		}
+	// block sums in parallel, then scan only the block we land in
+	const int64_t n = q.amp.size();
+	const int64_t nblock = min<int64_t>(256, n / PARALLEL_MIN + 1);
+	vector<float> blockProb(nblock, 0);
+	OMP_FOR(n)
+	for (int64_t b = 0; b < nblock; ++b)
+	{
+		float sum = 0;
+		for (int64_t i = n * b / nblock; i < n * (b + 1) / nblock; ++i)
+			sum += q.prob_internal(i);
+		blockProb[b] = sum;
+	}
+	int64_t b = 0;
+	while (b < nblock - 1 && prob > blockProb[b])
+		prob -= blockProb[b++];
+	// The block was picked by its float sum, rounding can leave prob > 0 at its end:
+	// then the last nonzero base seen wins
+	int64_t last = -1;
+	for (int64_t i = n * b / nblock; i < n * (b + 1) / nblock; ++i)
+	{
+		float p = q.prob_internal(i);
+		if (p == 0) continue;
+		last = i;
+		prob -= p;
+		if (prob <= 0)
+			return q.get_base_internal(i);
+	}
+	// an all-zero block: the last nonzero base of the register
+	for (int64_t i = n - 1; last < 0 && i >= 0; --i)
+		if (q.prob_internal(i) > 0)
+			last = i;
+	if (last >= 0)
+		return q.get_base_internal(size_t(last));
 
 	// should never be here
 	//throw QuantumException("Measurement fails, probability doesn't sum up to 1.");
-	return 1 << q.nqubit; // return the last state
+	return (qubase(1) << q.nqubit) - 1; // return the last state
 }
 
 int measure(Q, int tar, bool destructive)
@@ -254,89 +422,320 @@ int measure(Q, int tar, bool destructive)
 	qubase t = q.to_qubase(tar);
 
 	// get probability of this target bit collapsing to 0 or 1
-	if (q.dense)
+	const int64_t n = q.amp.size();
+	OMP_FOR_SUM(prob, n)
+	for (int64_t i = 0; i < n; ++i)
+		if (q.get_base_internal(i) & t) // target bit 1
+			prob += q.prob_internal(i);
+	if (prob > rand_float())
+		result = 1;
+	if (!destructive) // don't update the qureg
+		return result;
+	// eliminate all states that don't agree, at the next settle()
+	q.collapse(t, result ? t : 0, 1 / (result == 1 ? sqrt(prob) : sqrt(1 - prob)));
+	return result;
+}
+
+void Qureg::settle_collapse(qubase flip, qubase phase)
+{
+	const qubase mask = pendingMask, value = pendingValue;
+	const float scale = pendingScale;
+	pendingMask = pendingValue = 0;
+	pendingScale = 1;
+	// new amp[base] = factor(base) * old amp[base ^ flip]
+	auto factor = [=](qubase base)
 	{
-		auto& amp = q.amp;
-		DENSE_ITER(base)
-			if (base & t) // target bit 1
-				prob += norm(amp[base]);
-		if (prob > rand_float())
-			result = 1;
-		if (!destructive)
-			return result;
-		float newNorm = result == 1 ? sqrt(prob) : sqrt(1 - prob);
-		// eliminate all states that don't agree
-		DENSE_ITER(base)
-			if (((base & t) != 0) == result)
-				amp[base] /= newNorm;
-			else
-				amp[base] = CX(0);
+		if (((base ^ flip) & mask) != value)
+			return 0.0f;
+		return bit_count(base & phase) & 1 ? -scale : scale;
+	};
+
+	const int64_t n = amp.size();
+	if (dense)
+	{
+		if (!flip)
+		{
+			OMP_FOR(n)
+			for (int64_t base = 0; base < n; ++base)
+				amp[base] = cx_mul(factor(base), amp[base]);
+		}
+		else
+		{
+			// swap the pairs {base, base ^ flip} once each
+			const qubase pivot = flip & -flip;
+			OMP_FOR(n)
+			for (int64_t base = 0; base < n; ++base)
+				if (!(base & pivot))
+				{
+					CX a = amp[base];
+					amp[base] = cx_mul(factor(base), amp[base ^ flip]);
+					amp[base ^ flip] = cx_mul(factor(base ^ flip), a);
+				}
+		}
 	}
-	else // sparse
+	else
 	{
-		for (qubase& base : q.base_iter_s())
-			if (base & t) // target bit 1
-				prob += norm(q[base]);
-		if (prob > rand_float())
-			result = 1;
-		if (!destructive) // don't update the qureg
-			return result;
-		float newNorm = result == 1 ? sqrt(prob) : sqrt(1 - prob);
-
-		vector<CX> newAmp;
-		newAmp.reserve(q.amp.capacity() / 2);
-		vector<qubase> newBasis;
-		newBasis.reserve(q.basis.capacity() / 2);
+		// relabeled bases need a fresh basemap
+		if (flip)
+			basemap.clear();
 		size_t s = 0; // new size
-		for (qubase& base : q.base_iter_s())
-			if (((base & t) != 0) == result)
+		for (int64_t i = 0; i < n; ++i)
+		{
+			qubase base = basis[i];
+			if ((base & mask) == value)
 			{
-				newAmp.push_back(q[base] / newNorm);
-				newBasis.push_back(base);
-				q.basemap[base] = s++;
+				base ^= flip;
+				amp[s] = cx_mul(factor(base), amp[i]);
+				basis[s] = base;
+				basemap[base] = s++;
 			}
-			else // eliminate that base
-				q.basemap.erase(base);
-		q.amp = move(newAmp);
-		q.basis = move(newBasis);
+			else if (!flip) // eliminate that base
+				basemap.erase(base);
+		}
+		amp.resize(s);
+		basis.resize(s);
 	}
+}
+
+int reset(Q, int tar)
+{
+	int result = measure(q, tar);
+	// |0> already, after the pending collapse. Otherwise flip in the same pass
+	if (result)
+		q.settle_collapse(q.to_qubase(tar));
 	return result;
 }
 
-uint64_t measure_top(Q, int topSize, bool destructive)
+void pauli_correct(Q, int tar, bool x, bool z)
+{
+	if (x || z)
+		q.settle_collapse(x ? q.to_qubase(tar) : 0, z ? q.to_qubase(tar) : 0);
+}
+
+int measure_and_remove(Q, int tar)
+{
+	int result = measure(q, tar);
+	q.remove_qubit(tar);
+	return result;
+}
+
+void Qureg::remove_qubit(int tar)
 {
-	if (destructive)
+	const qubase t = to_qubase(tar);
+	if (!(pendingMask & t))
+		throw QuantumException("Only a measured qubit can be removed");
+	const qubase mask = pendingMask, value = pendingValue;
+	const float scale = pendingScale;
+	pendingMask = pendingValue = 0;
+	pendingScale = 1;
+	// bits below t stay, bits above t move down by one
+	const qubase lowMask = t - 1;
+
+	const int64_t n = amp.size();
+	if (dense)
 	{
-		// partial measurement: discard the last output bits
-		uint64_t result = 0;
-		for (int qi = 0; qi < topSize; ++qi)
-			// going from msb to lsb
-			result |= measure(q, qi) << (topSize - 1 - qi);
-		return result;
+		const int64_t half = n / 2;
+		vector<CX> newAmp(half);
+		OMP_FOR(half)
+		for (int64_t i = 0; i < half; ++i)
+		{
+			qubase base = ((i & ~lowMask) << 1) | (value & t) | (i & lowMask);
+			newAmp[i] = (base & mask) == value ? cx_mul(scale, amp[base]) : CX(0);
+		}
+		amp = std::move(newAmp);
 	}
 	else
-		return measure(q) >> (q.nqubit - topSize);
+	{
+		basemap.clear();
+		size_t s = 0; // new size
+		for (int64_t i = 0; i < n; ++i)
+		{
+			qubase base = basis[i];
+			if ((base & mask) == value)
+			{
+				qubase newBase = ((base >> 1) & ~lowMask) | (base & lowMask);
+				amp[s] = cx_mul(scale, amp[i]);
+				basis[s] = newBase;
+				basemap[newBase] = s++;
+			}
+		}
+		amp.resize(s);
+		basis.resize(s);
+	}
+	--nqubit;
+}
+
+vector<float> marginals(Q)
+{
+	const int n = q.nqubit;
+	const int64_t size = q.amp.size();
+	const int64_t nblock = min<int64_t>(256, size / PARALLEL_MIN + 1);
+	vector<float> probs(nblock * n, 0);
+	OMP_FOR(size)
+	for (int64_t b = 0; b < nblock; ++b)
+	{
+		float *p = &probs[b * n];
+		for (int64_t i = size * b / nblock; i < size * (b + 1) / nblock; ++i)
+		{
+			float prob = q.prob_internal(i);
+			// qubit 0 is the most significant bit
+			for (qubase base = q.get_base_internal(i); base; base &= base - 1)
+				p[n - 1 - bit_ctz(base)] += prob;
+		}
+	}
+	for (int64_t b = 1; b < nblock; ++b)
+		for (int qi = 0; qi < n; ++qi)
+			probs[qi] += probs[b * n + qi];
+	probs.resize(n);
+	return probs;
+}
+
+// Probability histogram over nout outcomes, keyOf(base) the outcome of a base.
+// Blocks keep private histograms while those are small next to amp[]
+template<typename KeyOf>
+static vector<float> block_histogram(Q, int64_t nout, KeyOf keyOf)
+{
+	const int64_t n = q.amp.size();
+	int64_t nblock = min<int64_t>(256, n / PARALLEL_MIN + 1);
+	if (nblock * nout > n)
+		nblock = 1;
+
+	vector<float> hist(nblock * nout, 0);
+	OMP_FOR(n)
+	for (int64_t b = 0; b < nblock; ++b)
+	{
+		float *h = &hist[b * nout];
+		for (int64_t i = n * b / nblock; i < n * (b + 1) / nblock; ++i)
+			h[keyOf(q.get_base_internal(i))] += q.prob_internal(i);
+	}
+	for (int64_t b = 1; b < nblock; ++b)
+		for (int64_t out = 0; out < nout; ++out)
+			hist[out] += hist[b * nout + out];
+	hist.resize(nout);
+	return hist;
+}
+
+vector<float> marginal_distribution(Q, int startBit, int qsize)
+{
+	const int shift = q.nqubit - startBit - qsize;
+	const qubase outMask = (qubase(1) << qsize) - 1;
+	return block_histogram(q, int64_t(1) << qsize, 
+		[=](qubase base) { return (base >> shift) & outMask; });
+}
+
+uint64_t measure_top(Q, int topSize, bool destructive)
+{
+	return measure_range(q, 0, topSize, destructive);
 }
 
 uint64_t measure_range(Q, int startBit, int qsize, bool destructive)
 {
-	int endBit = startBit + qsize;
-	if (destructive)
+	const int shift = q.nqubit - startBit - qsize;
+	const uint64_t outMask = (uint64_t(1) << qsize) - 1;
+	if (!destructive)
+		return (measure(q) >> shift) & outMask;
+
+	// partial measurement: one pass for the marginals, one for the collapse
+	vector<float> hist = marginal_distribution(q, startBit, qsize);
+	uint64_t result = 0;
+	for (float prob = rand_float(); result < outMask; ++result)
+		if (hist[result] > 0 && (prob -= hist[result]) <= 0)
+			break;
+	// rounding may run past the last possible outcome
+	while (hist[result] == 0 && result > 0)
+		--result;
+	q.collapse(outMask << shift, result << shift, 1 / sqrt(hist[result]));
+	return result;
+}
+
+// Shots drawn by one RNG stream
+#define SAMPLE_CHUNK 4096
+
+vector<uint64_t> sample(Q, size_t shots, const vector<int>& qubits)
+{
+	// cumulative probabilities over the outcomes
+	vector<double> cumul;
+	if (!qubits.empty())
 	{
-		// partial measurement: discard the last output bits
-		uint64_t result = 0;
-		for (int qi = startBit; qi < endBit; ++qi)
-			// going from msb to lsb
-			result |= measure(q, qi) << (endBit - 1 - qi);
-		return result;
+		// only 2^k outcomes: tabulate their marginal, not the whole register
+		vector<qubase> masks;
+		for (int qi : qubits)
+			masks.push_back(q.to_qubase(qi));
+		vector<float> hist = block_histogram(q, int64_t(1) << qubits.size(), 
+			[&](qubase base)
+			{
+				uint64_t outcome = 0;
+				for (qubase mask : masks)
+					outcome = (outcome << 1) | ((base & mask) != 0);
+				return outcome;
+			});
+		cumul.resize(hist.size());
+		double sum = 0;
+		for (size_t out = 0; out < hist.size(); ++out)
+			cumul[out] = sum += hist[out];
 	}
 	else
-		return measure(q) >> (q.nqubit - endBit);
+	{
+		// one entry per stored base: block sums first, then each block scans from its offset
+		const int64_t n = q.amp.size();
+		const int64_t nblock = min<int64_t>(256, n / PARALLEL_MIN + 1);
+		vector<double> blockStart(nblock + 1, 0);
+		cumul.resize(n);
+		OMP_FOR(n)
+		for (int64_t b = 0; b < nblock; ++b)
+		{
+			double sum = 0;
+			for (int64_t i = n * b / nblock; i < n * (b + 1) / nblock; ++i)
+				sum += q.prob_internal(i);
+			blockStart[b + 1] = sum;
+		}
+		for (int64_t b = 0; b < nblock; ++b)
+			blockStart[b + 1] += blockStart[b];
+		OMP_FOR(n)
+		for (int64_t b = 0; b < nblock; ++b)
+		{
+			double sum = blockStart[b];
+			for (int64_t i = n * b / nblock; i < n * (b + 1) / nblock; ++i)
+				cumul[i] = sum += q.prob_internal(i);
+		}
+	}
+	const int64_t n = cumul.size();
+	const double total = cumul.back();
+
+	// seeds drawn up front, so the outcome doesn't depend on the thread count
+	const int64_t nchunk = (shots + SAMPLE_CHUNK - 1) / SAMPLE_CHUNK;
+	vector<unsigned> seeds(nchunk);
+	for (auto& seed : seeds)
+		seed = rand_next();
+
+	vector<uint64_t> results(shots);
+	OMP_FOR(int64_t(shots))
+	for (int64_t c = 0; c < nchunk; ++c)
+	{
+		std::mt19937 engine(seeds[c]);
+		std::uniform_real_distribution<double> uniform(0, total);
+		for (size_t s = c * SAMPLE_CHUNK; s < min(shots, size_t(c + 1) * SAMPLE_CHUNK); ++s)
+		{
+			int64_t i = std::upper_bound(cumul.begin(), cumul.end(), uniform(engine)) - cumul.begin();
+			i = min(i, n - 1);
+			results[s] = qubits.empty() ? q.get_base_internal(i) : uint64_t(i);
+		}
+	}
+	return results;
+}
+
+unordered_map<uint64_t, size_t> sample_histogram(Q, size_t shots, const vector<int>& qubits)
+{
+	unordered_map<uint64_t, size_t> histogram;
+	for (uint64_t outcome : sample(q, shots, qubits))
+		++histogram[outcome];
+	return histogram;
 }
 
 // Apply to n most significant bits
 void apply_oracle(Q, const oracle_function& oracle, int inputQubits)
 {
+	q.settle();
 	if (inputQubits >= q.nqubit)
 		throw QuantumException("inputQubits should not exceed total qubits");
 	int outputQubits = q.nqubit - inputQubits;
@@ -372,7 +771,7 @@ void apply_oracle(Q, const oracle_function& oracle, int inputQubits)
 			uint64_t input = base >> outputQubits; // most sig bits
 			uint64_t output = base & outputMask;
 			uint64_t ans = oracle(input);
-			if (norm(q[base]) < TOL)
+			if (cx_norm(q[base]) < TOL)
 				continue;  // purge along the way
 			newAmp.push_back(q[base]);
 			qubase newBase = input << outputQubits | (output ^ ans);
@@ -383,4 +782,141 @@ void apply_oracle(Q, const oracle_function& oracle, int inputQubits)
 		q.basis = move(newBasis);
 		q.basemap = move(newBasemap);
 	}
-}
\ No newline at end of file
+}
+// Helper for apply_oracle: gather/scatter an integer from/to a list of qubits
+// The first qubit is the most significant bit
+struct QubitList
+{
+	qubase mask; // all qubits in the list
+	bool ordered; // listed in register order, so PEXT/PDEP apply directly
+	vector<qubase> bits;
+
+	QubitList(Q, const vector<int>& qubits) : mask(0), ordered(true)
+	{
+		for (int qi : qubits)
+		{
+			if (qi < 0 || qi >= q.nqubit)
+				throw QuantumException("qubit index out of range");
+			qubase b = q.to_qubase(qi);
+			if (mask & b)
+				throw QuantumException("duplicate qubit in the list");
+			if (!bits.empty() && b > bits.back())
+				ordered = false;
+			mask |= b;
+			bits.push_back(b);
+		}
+	}
+
+	INLINE uint64_t gather(qubase base) const
+	{
+		if (ordered)
+			return bit_gather(base, mask);
+		uint64_t x = 0;
+		for (qubase b : bits)
+			x = (x << 1) | ((base & b) != 0);
+		return x;
+	}
+
+	INLINE qubase scatter(uint64_t x) const
+	{
+		if (ordered)
+			return bit_scatter(x, mask);
+		qubase base = 0;
+		for (size_t i = bits.size(); i-- > 0; x >>= 1)
+			if (x & 1)
+				base |= bits[i];
+		return base;
+	}
+};
+
+void apply_oracle(Q, const oracle_function& oracle, 
+	const vector<int>& inputQubits, const vector<int>& outputQubits)
+{
+	q.settle();
+	QubitList in(q, inputQubits);
+	QubitList out(q, outputQubits);
+	if (in.mask & out.mask)
+		throw QuantumException("input and output qubits should not overlap");
+
+	if (q.dense)
+	{
+		auto& amp = q.amp;
+		// all the bits that are not taken as oracle input
+		qubase restMask = ((qubase(1) << q.nqubit) - 1) & ~in.mask;
+		for (uint64_t input = 0; input < qubase(1) << inputQubits.size(); ++input)
+		{
+			qubase ans = out.scatter(oracle(input));
+			if (ans == 0) continue;
+			// |b> and |b xor ans> swap with each other. 
+			// Enumerate only the half with 0 at the lowest bit of ans
+			qubase pivotMask = restMask & ~(ans & -ans);
+			qubase inBase = in.scatter(input);
+			MASKED_ITER(base, pivotMask, inBase)
+				std::swap(amp[base], amp[base ^ ans]);
+		}
+	}
+	else
+	{
+		vector<CX> newAmp;
+		newAmp.reserve(q.amp.capacity());
+		vector<qubase> newBasis;
+		newBasis.reserve(q.basis.capacity());
+		decltype(q.basemap) newBasemap(q.basemap.size());
+		size_t s = 0; // new size
+
+		for (qubase& base : q.base_iter_s())
+		{
+			if (cx_norm(q[base]) < TOL)
+				continue;  // purge along the way
+			qubase newBase = base ^ out.scatter(oracle(in.gather(base)));
+			newAmp.push_back(q[base]);
+			newBasis.push_back(newBase);
+			newBasemap[newBase] = s++;
+		}
+		q.amp = move(newAmp);
+		q.basis = move(newBasis);
+		q.basemap = move(newBasemap);
+	}
+}
+
+void apply_permutation(Q, const oracle_function& perm, 
+	const vector<int>& tars, const vector<int>& ctrls)
+{
+	q.settle();
+	QubitList tar(q, tars), ctrl(q, ctrls);
+	if (tar.mask & ctrl.mask)
+		throw QuantumException("Control and target qubits should not overlap");
+
+	const uint64_t size = uint64_t(1) << tars.size();
+	vector<qubase> src(size), dst(size);
+	for (uint64_t x = 0; x < size; ++x)
+	{
+		src[x] = tar.scatter(x);
+		dst[x] = tar.scatter(perm(x));
+	}
+
+	if (q.dense)
+	{
+		auto& amp = q.amp;
+		vector<CX> tmpAmp(size);
+		MASKED_ITER(base, q.full_mask() & ~(tar.mask | ctrl.mask), ctrl.mask)
+		{
+			for (uint64_t x = 0; x < size; ++x)
+				tmpAmp[x] = amp[base | src[x]];
+			for (uint64_t x = 0; x < size; ++x)
+				amp[base | dst[x]] = tmpAmp[x];
+		}
+	}
+	else
+	{
+		// relabel the bases, a bijection never collides
+		q.basemap.clear();
+		for (size_t i = 0; i < q.basis.size(); ++i)
+		{
+			qubase& base = q.basis[i];
+			if ((base & ctrl.mask) == ctrl.mask)
+				base = (base & ~tar.mask) | dst[tar.gather(base)];
+			q.basemap[base] = i;
+		}
+	}
+}
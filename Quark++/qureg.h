@@ -23,6 +23,11 @@ private:
 	// if basis is empty, we iterate over all 2^nqubit basis
 	vector<qubase> basis; 
 
+	// Deferred measurement collapse: only bases with (base & pendingMask) == pendingValue
+	// survive, multiplied by pendingScale. Applied by settle()
+	qubase pendingMask = 0, pendingValue = 0;
+	float pendingScale = 1;
+
 	/*
 	 * Private ctor
 	 *	Dense: we don't store the basis explicitly
@@ -34,6 +39,39 @@ private:
 	 */
 	Qureg(bool dense, int nqubit, qubase initBase, size_t reservedSize, bool init);
 
+	/*
+	 *	Measurement collapse: keep only the bases with (base & mask) == value
+	 * and multiply them by 'scale'. Only recorded here, the write pass is 
+	 * deferred to settle() so that consecutive measurements share it
+	 */
+	INLINE void collapse(qubase mask, qubase value, float scale)
+	{
+		pendingMask |= mask;
+		pendingValue |= value;
+		pendingScale *= scale;
+	}
+
+	/*
+	 *	Apply the pending collapse. Sparse bases are compacted in place.
+	 * In the same pass, Pauli X is applied on the bits of 'flip', 
+	 * then Pauli Z on the bits of 'phase'.
+	 */
+	void settle_collapse(qubase flip = 0, qubase phase = 0);
+
+	/*
+	 *	Drop a qubit fixed by a pending measurement: the agreeing half of 
+	 * amp[] is kept, nqubit decreases and later qubits move up one index.
+	 * The pending collapse is applied in the same pass.
+	 */
+	void remove_qubit(int tar);
+
+	/*
+	 *	Shared by the closed-form factories: amp = ampOf(x) for every value x 
+	 * of the subregister, the qubits outside of it as in initBase
+	 */
+	template<bool dense, typename AmpOf>
+	static Qureg create_subregister(int nqubit, int startBit, int qsize, qubase initBase, AmpOf ampOf);
+
 	/*
 	 *	Disallow copying. Use clone() explicitly when needed.
 	 */
@@ -43,7 +81,7 @@ private:
 public:
 	int nqubit; // number of qubits
 	bool dense; // if we don't store basis[] explicitly
-	vector<CX> amp; // amplitudes
+	vector<CX> amp; // amplitudes. May hold a pending collapse: settle() before touching it
 
 	/*
 	 *	Dummy ctor for reference declaration
@@ -58,7 +96,10 @@ public:
 		dense(other.dense),
 		amp(std::move(other.amp)),
 		basemap(std::move(other.basemap)),
-		basis(std::move(other.basis)) { }
+		basis(std::move(other.basis)),
+		pendingMask(other.pendingMask),
+		pendingValue(other.pendingValue),
+		pendingScale(other.pendingScale) { }
 
 	Qureg& operator=(Qureg&& other)
 	{
@@ -67,6 +108,9 @@ public:
 		amp = std::move(other.amp);
 		basemap = std::move(other.basemap);
 		basis = std::move(other.basis);
+		pendingMask = other.pendingMask;
+		pendingValue = other.pendingValue;
+		pendingScale = other.pendingScale;
 		return *this;
 	}
 
@@ -80,11 +124,33 @@ public:
 	template<bool dense>
 	static Qureg create(int nqubit, size_t reservedSize, qubase initBase);
 
+	/*
+	 *	Closed-form initial states, amp[] filled in one parallel write pass
+	 * instead of running the gates. The subregister is the qubits 
+	 * [startBit, startBit + qsize), qsize = -1 means up to the last qubit. 
+	 * The qubits outside of it stay as in initBase.
+	 * create_uniform: hadamard on the subregister of |initBase>. Uniform 
+	 *   superposition with signs (-1)^(x . initBase)
+	 * create_qft: qft on the subregister of |initBase>
+	 */
+	template<bool dense>
+	static Qureg create_uniform(int nqubit, int startBit = 0, int qsize = -1, qubase initBase = 0);
+
+	template<bool dense>
+	static Qureg create_qft(int nqubit, int startBit = 0, int qsize = -1, qubase initBase = 0);
+
+	/*
+	 *	GHZ state (|00..0> + |11..1>) / sqrt(2). nqubit = 2 is the Bell state
+	 */
+	template<bool dense>
+	static Qureg create_ghz(int nqubit);
+
 	/**********************************************/
 	/*********** Dense ONLY  ***********/
 	/**********************************************/
 	INLINE void set_base_d(qubase base, CX a)
 	{
+		settle();
 		amp[base] = a;
 	}
 
@@ -93,14 +159,25 @@ public:
 	 */
 #define DENSE_ITER(base) for (qubase base = 0; base < (1<<q.nqubit); ++base)
 
+	/*
+	 * Iterate only over the 2^bit_count(freeMask) basis that equal 'fixed'
+	 * outside of freeMask, e.g. control bits 1 and target bit 0.
+	 * Each base is deposited from its index by PDEP (see masked_next)
+	 */
+#define MASKED_ITER(base, freeMask, fixed) \
+	for (qubase base##_i = 0, base##_n = qubase(1) << bit_count(freeMask), base##_s = 0, base; \
+		base##_i < base##_n && ((base = masked_next(base##_i, base##_s, freeMask) | (fixed)), true); \
+		++base##_i)
+
 	/**********************************************/
 	/*********** Sparse ONLY  ***********/
 	/**********************************************/
 	/*
-	 *	Test if a base already exists in basis[]
+	 *	Test if a base already exists in basis[]. Settles a pending collapse first
 	 */
 	INLINE bool contains_base(qubase base)
 	{
+		settle();
 		return contains(basemap, base);
 	}
 
@@ -109,31 +186,40 @@ public:
 	 */
 	INLINE void add_base(qubase base, CX a)
 	{
+		settle();
 		basemap[base] = amp.size();
 		basis.push_back(base);
 		amp.push_back(a);
 	}
 
 	/*
-	 * Read index from basemap and get amplitude
+	 *	Move the entry of 'base' to 'newBase' in place, amplitude included.
+	 * newBase must not exist yet. Sparse ONLY.
 	 */
-	INLINE CX& operator[](qubase base) { return amp[basemap[base]]; }
+	INLINE void relabel_base(qubase base, qubase newBase)
+	{
+		size_t i = basemap[base];
+		basemap.erase(base);
+		basemap[newBase] = i;
+		basis[i] = newBase;
+	}
 
 	/*
-	 *	For-each loop over basis[]. You can append to basis[] as you iterate
+	 * Read index from basemap and get amplitude. Settles a pending collapse first
 	 */
-	INLINE VecRange<qubase> base_iter_s() { return VecRange<qubase>(basis); }
+	INLINE CX& operator[](qubase base) { settle(); return amp[basemap[base]]; }
+
+	/*
+	 *	For-each loop over basis[]. You can append to basis[] as you iterate.
+	 * Settles first, so operator[] inside the loop doesn't compact basis[]
+	 */
+	INLINE VecRange<qubase> base_iter_s() { settle(); return VecRange<qubase>(basis); }
 
 	/*
 	 *	Sort the basis vectors. 
-	 * The amp array is NOT sorted, cause basemap takes care of indices
+	 * amp[] follows, so amp[i] stays the amplitude of basis[i]
 	 */
-	Qureg& sort()
-	{
-		if (!dense)
-			std::sort(basis.begin(), basis.end());
-		return *this;
-	}
+	Qureg& sort();
 
 	/*
 	 *	Remove near-zero amplitude, tolerance defined by TOL
@@ -144,9 +230,10 @@ public:
 	/*********** Common part  ***********/
 	/**********************************************/
 	/*
-	*	Size of complex amplitude vector
+	*	Size of complex amplitude vector. Settles a pending collapse first, 
+	* so a sparse register counts only the surviving bases
 	*/
-	INLINE size_t size() { return amp.size(); }
+	INLINE size_t size() { settle(); return amp.size(); }
 
 	/*
 	 *	Explicit copying
@@ -159,6 +246,26 @@ public:
 	 */
 	INLINE qubase get_base_internal(size_t i) { return dense ? i : basis[i]; }
 
+	/*
+	 *	Probability stored at an internal index, pending collapse included.
+	 * Measurements read through this, so they don't need to settle()
+	 */
+	INLINE float prob_internal(size_t i)
+	{
+		return (get_base_internal(i) & pendingMask) == pendingValue ?
+			cx_norm(amp[i]) * (pendingScale * pendingScale) : 0;
+	}
+
+	/*
+	 *	Apply a deferred measurement collapse, if any.
+	 * Every operation that reads or writes amp[] directly must call this first
+	 */
+	INLINE void settle()
+	{
+		if (pendingMask)
+			settle_collapse();
+	}
+
 	/*
 	 *	Get a bit string representing a target qubit
 	 * Most significant bit
@@ -168,6 +275,11 @@ public:
 		return qubase(1) << (nqubit - 1 - tar);
 	}
 
+	/*
+	 *	All nqubit bits set
+	 */
+	INLINE qubase full_mask() { return (qubase(1) << nqubit) - 1; }
+
 	/*
 	 *	If nonZeroOnly true, prints only states with non-zero amp
 	 * default true
@@ -201,8 +313,11 @@ public:
 
 	INLINE CX get_amp(const qubase& base)
 	{
-		return dense ? amp[base] : 
-			contains_base(base) ? (*this)[base] : CX(0);
+		if ((base & pendingMask) != pendingValue)
+			return CX(0);
+		CX a = dense ? amp[base] : 
+			contains(basemap, base) ? amp[basemap[base]] : CX(0);
+		return cx_mul(pendingScale, a);
 	}
 
 	/*
@@ -211,12 +326,30 @@ public:
 	 */
 	vector<pair<qubase, float>> sorted_non_zero_states();
 
+	/*
+	 *	The k most probable states with probability > cutoff, sorted like
+	 * sorted_non_zero_states(). Memory is O(k) per thread.
+	 * k = 0: threshold mode, every state above cutoff
+	 */
+	vector<pair<qubase, float>> top_k_states(size_t k, float cutoff = TOL);
+
 	/*
 	 *	Get the sum of probability of all bases with 'prefix'
 	 * nbit: prefix length
 	 */
 	float prefix_prob(int nbit, qubase prefix);
 
+	/*
+	 *	P(qubit i = 1) for every qubit i, all in one pass
+	 */
+	friend vector<float> marginals(Q);
+
+	/*
+	 *	Probability of every value of qubits [startBit, startBit + qsize), 
+	 * startBit the most significant. 2^qsize entries, one pass
+	 */
+	friend vector<float> marginal_distribution(Q, int startBit, int qsize);
+
 	///////************** Quantum operations **************///////
 	/*
 	 *	Measure the whole register
@@ -237,12 +370,62 @@ public:
 	 */
 	friend uint64_t measure_range(Q, int startBit, int qsize, bool destructive = true);
 
+	/*
+	 *	Measure 'tar' and remove it from the register: amp[] shrinks to 
+	 * 2^(nqubit-1) and qubits after 'tar' shift up one index.
+	 * Use when the outcome is all that's needed of the qubit afterwards
+	 */
+	friend int measure_and_remove(Q, int tar);
+
+	/*
+	 *	Measure 'tar' and leave it in |0>, ready to be reused as an ancilla.
+	 * Return the measured value
+	 */
+	friend int reset(Q, int tar);
+
+	/*
+	 *	Classical feed-forward: Pauli X on 'tar' if x, then Pauli Z if z.
+	 * Usually driven by measured bits, e.g. teleportation corrections.
+	 * Runs in the same pass that applies any pending measurement collapse
+	 */
+	friend void pauli_correct(Q, int tar, bool x, bool z);
+
+	/*
+	 *	Draw 'shots' measurement outcomes without touching the register.
+	 * A cumulative probability table is built once (over the 2^k outcomes 
+	 * when qubits are given), then every shot is a binary search. Shots are
+	 * drawn in parallel, each chunk with its own mt19937 seeded from 
+	 * rand_next(), so rand_seed() (or a RandScope) still fixes the result.
+	 * qubits: outcome bits, the first one most significant. Empty means all qubits
+	 */
+	friend vector<uint64_t> sample(Q, size_t shots, const vector<int>& qubits = vector<int>());
+	/*
+	 *	sample() as a histogram: outcome -> number of shots
+	 */
+	friend unordered_map<uint64_t, size_t> sample_histogram(Q, size_t shots, 
+		const vector<int>& qubits = vector<int>());
+
 	/*
 	 *	Apply an int -> int classical oracle on this register
 	 * inputQubits: how many most significant bits to be taken as input
 	 * take |x>|b> and map to |x>|b xor f(x)>
 	 */
 	friend void apply_oracle(Q, const oracle_function& oracle, int inputQubits);
+	/*
+	 *	Apply an int -> int classical oracle on arbitrary qubit subsets
+	 * x is read from inputQubits and f(x) is xor-ed onto outputQubits,
+	 * the first qubit in each list being the most significant bit.
+	 * Qubits in neither list are left untouched. No swaps needed.
+	 */
+	friend void apply_oracle(Q, const oracle_function& oracle,
+		const vector<int>& inputQubits, const vector<int>& outputQubits);
+	/*
+	 *	Apply a classical reversible function in place: |x> -> |perm(x)>
+	 * on 'tars' (the first qubit most significant), only where all 'ctrls' are 1.
+	 * perm must be a bijection on [0, 2^tars.size()). It is tabulated once
+	 */
+	friend void apply_permutation(Q, const oracle_function& perm, 
+		const vector<int>& tars, const vector<int>& ctrls = vector<int>());
 };
 
 
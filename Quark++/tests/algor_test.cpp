@@ -54,8 +54,9 @@ TEST(Algor, QftPeriod)
 		// N > 2 * r^2
 		for (int period = 2; period < sqrt(1<<(nbit - 2)) ; ++period)
 			for (int dense : Range<>(2))
+			for (int comb : Range<>(2))
 			{
-				Qureg q = qft_period(nbit, period, dense);
+				Qureg q = qft_period(nbit, period, dense, comb);
 				auto sorted = q.sorted_non_zero_states();
 
 				// Should be multiple of:  N / r  = 2^nbit / period
@@ -69,7 +70,8 @@ TEST(Algor, QftPeriod)
 					if (prob < expectProb * 0.7)
 						break;
 
-					qubase base = sorted[i].first >> nbit;
+					// the measured output qubits were dropped
+					qubase base = sorted[i].first >> (q.nqubit - nbit);
 
 					// {base(measured) * r / N} should be as close to an integer as possible
 					float k = (1.0 * base * period) / (1 << nbit);
@@ -113,6 +115,81 @@ TEST(Algor, Shor)
 	}
 }
 
+TEST(Algor, ShorModes)
+{
+	// Each entry is a 3-tuple: (nbit, prime1, prime2)
+	vector<vector<int>> trials =
+	{
+		{5, 3, 5},
+		{6, 13, 5},
+		{8, 17, 11},
+		{11, 31, 37}
+	};
+
+	for (auto& entry : trials)
+	for (int dense : Range<>(2))
+	for (ShorMode mode : { ShorMode::SemiClassical, ShorMode::Comb })
+	{
+		int nbit = entry[0];
+		int prime1 = entry[1];
+		int prime2 = entry[2];
+		int M = prime1 * prime2;
+
+		auto ans = shor_factorize(nbit, M, dense, mode);
+
+		ASSERT_TRUE((prime1 == ans.first || prime1 == ans.second) && ans.first * ans.second == M)
+			<< "M = " << M << " != " << ans.first << " * " << ans.second;
+	}
+}
+
+TEST(Algor, ShorPostProcess)
+{
+	// periods of 10^4 ~ 10^5, the period 1018 mod 1019 contributes a factor 509
+	const int M = 1019 * 1021, nbit = 40, bigFactor = 509;
+	for (int b : Range<>(2, 12))
+	{
+		uint64_t r = smallest_period(b, M);
+		if (r % 2 != 0 || exp_mod(b, r / 2, M) == M - 1 || r % bigFactor != 0)
+			continue;
+		// ideal top register measurement for s / r
+		auto measure = [=](uint64_t s)
+		{
+			return uint64_t(std::llround(double(s) / r * (uint64_t(1) << nbit)));
+		};
+		auto check = [=](pair<int, int> ans)
+		{
+			return (ans.first == 1019 || ans.second == 1019) && ans.first * ans.second == M;
+		};
+
+		// s coprime to r: r is a convergent denominator
+		ASSERT_TRUE(check(shor_post_process(nbit, M, b, { measure(1) }))) << "b = " << b;
+		// r / 2: found as a small multiple
+		ASSERT_TRUE(check(shor_post_process(nbit, M, b, { measure(2) }))) << "b = " << b;
+		// r / 509 and 509 alone are too far from r, their lcm isn't
+		uint64_t s1 = bigFactor, s2 = r / bigFactor;
+		ASSERT_FALSE(check(shor_post_process(nbit, M, b, { measure(s1) }))) << "b = " << b;
+		ASSERT_TRUE(check(shor_post_process(nbit, M, b, { measure(s1), measure(s2) }))) << "b = " << b;
+	}
+}
+
+TEST(Algor, ShorBatch)
+{
+	// (prime1, prime2), all factorized with the same precision
+	vector<pair<int, int>> primes = { {3, 5}, {13, 5}, {17, 11}, {7, 19}, {3, 29} };
+	vector<int> Ms;
+	for (auto& p : primes) Ms.push_back(p.first * p.second);
+
+	for (int dense : Range<>(2))
+	{
+		auto ans = shor_factorize_batch(9, Ms, dense, ShorMode::Comb);
+		ASSERT_EQ(Ms.size(), ans.size());
+		for (int m : Range<>(Ms.size()))
+			ASSERT_TRUE((primes[m].first == ans[m].first || primes[m].first == ans[m].second)
+				&& ans[m].first * ans[m].second == Ms[m])
+				<< "M = " << Ms[m] << " != " << ans[m].first << " * " << ans[m].second;
+	}
+}
+
 TEST(Algor, Grover)
 {
 	for (int nbit : Range<>(3, 8))
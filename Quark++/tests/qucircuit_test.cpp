@@ -0,0 +1,55 @@
+#include "tests.h"
+#include "../qucircuit.h"
+
+// Random mix of 1-qubit, 2-qubit and controlled gates
+Circuit rand_circuit(int nqubit, int ngate)
+{
+	Circuit gates;
+	vector<int> perm(nqubit);
+	for (int g : Range<>(ngate))
+	{
+		for (int i : Range<>(nqubit)) perm[i] = i;
+		rand_shuffle(perm);
+		int ntar = rand_int(1, 3);
+		int nctrl = rand_int(0, nqubit - ntar + 1);
+		vector<int> tars(perm.begin(), perm.begin() + ntar);
+		vector<int> ctrls(perm.begin() + ntar, perm.begin() + ntar + nctrl);
+		vector<int> ctrlValues;
+		for (int c : Range<>(nctrl))
+			ctrlValues.push_back(rand_int(0, 2));
+		gates.push_back(GateOp(rand_cxmat(1 << ntar, 1 << ntar, .5), tars, ctrls, ctrlValues));
+	}
+	return gates;
+}
+
+TEST(Qucircuit, BlockedApply)
+{
+	for (int nqubit : QubitRange(3))
+	for (int trial : Range<>(5))
+	{
+		Circuit gates = rand_circuit(nqubit, 20);
+		int blockQubits = rand_int(1, nqubit + 2);
+
+		Qureg q = rand_qureg_dense(nqubit, 1);
+		Qureg qc = q.clone();
+		Qucircuit::apply(qc, gates);
+		Qucircuit::blocked_apply(q, gates, blockQubits);
+		ASSERT_MAT(VectorXcf(qc), VectorXcf(q), "Blocked VS gate-by-gate sweeps");
+	}
+}
+
+TEST(Qucircuit, ScheduledApply)
+{
+	for (int nqubit : QubitRange(3))
+	for (int trial : Range<>(5))
+	{
+		Circuit gates = rand_circuit(nqubit, 40);
+		int blockQubits = rand_int(2, nqubit + 1);
+
+		Qureg q = rand_qureg_dense(nqubit, 1);
+		Qureg qc = q.clone();
+		Qucircuit::apply(qc, gates);
+		Qucircuit::scheduled_apply(q, gates, blockQubits, rand_int(1, 20));
+		ASSERT_MAT(VectorXcf(qc), VectorXcf(q), "Reordered VS gate-by-gate sweeps");
+	}
+}
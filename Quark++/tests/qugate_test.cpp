@@ -116,6 +116,117 @@ TEST(Qugate, GenericGateN)
 	}
 }
 
+TEST(Qugate, GenericGateFixedSize)
+{
+	// K = 1..5 run the fixed-size kernels, K = 6 the dynamic one
+	const int NQUBIT = 6;
+	vector<int> tars;
+	for (int nqubit : QubitRange(NQUBIT))
+	for (int K = 1; K <= NQUBIT; ++K)
+	{
+		Qureg qd = rand_qureg_dense(nqubit, 1);
+		Qureg qs = rand_qureg_sparse(nqubit, half_fill(nqubit), 1, false);
+		Qureg QQs[] = { move(qd), move(qs) };
+
+		for (Qureg& q : QQs)
+		{
+			tars.resize(K);
+			rand_shuffle(rand_unique(tars, K, nqubit));
+			Qureg qc = q.clone();
+			MatrixXcf kroneckeredMat = rand_cxmat(2, 2, .5);
+			generic_gate(qc, Matrix2cf(kroneckeredMat), tars[0]);
+			for (int i = 1; i < K; ++i)
+			{
+				Matrix2cf mat = rand_cxmat(2, 2, .5);
+				kroneckeredMat = kroneckeredMat & mat;
+				generic_gate(qc, mat, tars[i]);
+			}
+
+			if (K == 3) // explicit fixed-size call
+				generic_gate<3>(q, Matrix<CX, 8, 8>(kroneckeredMat), tars);
+			else
+				generic_gate(q, kroneckeredMat, tars);
+			ASSERT_MAT(VectorXcf(qc), VectorXcf(q), "Fixed-size VS single-qubit gates");
+		}
+	}
+}
+
+TEST(Qugate, StructuredGate1)
+{
+	for (int nqubit : QubitRange(2))
+	{
+		Qureg qd = rand_qureg_dense(nqubit, 1);
+		Qureg qs = rand_qureg_sparse(nqubit, half_fill(nqubit), 1);
+		Qureg QQs[] = { move(qd), move(qs) };
+
+		for (Qureg& q : QQs)
+		for (int kind : Range<>(6))
+		{
+			Matrix2cf mat = rand_cxmat<2, 2>(.5);
+			switch (kind)
+			{
+			case 0: mat(0, 1) = mat(1, 0) = 0; break; // diagonal
+			case 1: mat(0, 1) = mat(1, 0) = 0; mat(0, 0) = 1; break; // phase
+			case 2: mat(0, 0) = mat(1, 1) = 0; break; // anti-diagonal
+			case 3: mat = Matrix2cf(mat.real().cast<CX>()); break; // real
+			case 4: mat(1, 0) = 0; break; // upper triangular
+			}
+			int tar = rand_int(0, nqubit);
+			int ctrl = (tar + rand_int(1, nqubit)) % nqubit;
+			size_t oldSize = q.size();
+
+			// reference: the k-qubit kernels, which don't look at structure
+			Qureg qc = q.clone();
+			generic_gate(qc, Matrix4cf(Matrix2cf::Identity() & mat), ctrl, tar);
+			generic_gate(q, mat, tar);
+			ASSERT_MAT(VectorXcf(qc), VectorXcf(q), "Structured single-qubit gate");
+			if (!q.dense && kind <= 2)
+				ASSERT_EQ(oldSize, q.size()) << "(Anti-)diagonal gate should not add bases";
+
+			generic_gate(qc, generic_control_mat(1, mat), ctrl, tar);
+			generic_control(q, mat, ctrl, tar);
+			ASSERT_MAT(VectorXcf(qc), VectorXcf(q), "Structured controlled gate");
+		}
+	}
+}
+
+TEST(Qugate, SparseMatrixGate)
+{
+	vector<int> tars;
+	for (int nqubit : QubitRange(4))
+	{
+		Qureg qd = rand_qureg_dense(nqubit, 1);
+		Qureg qs = rand_qureg_sparse(nqubit, half_fill(nqubit), 1);
+		Qureg QQs[] = { move(qd), move(qs) };
+
+		for (Qureg& q : QQs)
+		for (int trial : Range<>(6))
+		{
+			int k = rand_int(2, 5);
+			tars.resize(k);
+			rand_shuffle(rand_unique(tars, k, nqubit));
+			MatrixXcf mat;
+			switch (trial % 3)
+			{
+			case 0: mat = generic_control_mat(k - 1, rand_cxmat<2, 2>(.5)); break;
+			case 1: mat = generic_control_mat(k - 1, pauli_X_mat()); break;
+			default: // random sparse, with some identity rows
+				mat = MatrixXcf::Identity(1 << k, 1 << k);
+				for (int e : Range<>(1 << k))
+					mat(rand_int(0, 1 << k), rand_int(0, 1 << k)) = rand_cx(.5);
+			}
+
+			Qureg qc = q.clone();
+			generic_gate(qc, mat, tars);
+			generic_gate(q, SparseMatrix<CX>(mat.sparseView()), tars);
+			// sums of up to 2^k terms of magnitude above 1, in another order: TOL relative
+			VectorXcf expected = VectorXcf(qc);
+			ASSERT_MAT(expected, VectorXcf(q), "Sparse VS dense operator", 
+				TOL * max(1.0f, expected.cwiseAbs().maxCoeff()));
+		}
+	}
+}
+
 TEST(Qugate, PauliXYZ)
 {
 	std::function<void(Qureg&, int)> 
@@ -262,4 +373,36 @@ TEST(Qugate, Cswap)
 			ASSERT_MAT(oldAmp, newAmp);
 		}
 	}
-}
\ No newline at end of file
+}
+
+TEST(Qugate, PermuteQubits)
+{
+	vector<int> perm;
+	for (int nqubit : QubitRange(2))
+	{
+		Qureg qd = rand_qureg_dense(nqubit, 1);
+		Qureg qs = rand_qureg_sparse(nqubit, half_fill(nqubit), 1);
+		Qureg QQs[] = { move(qd), move(qs) };
+
+		perm.resize(nqubit);
+		for (Qureg& q : QQs)
+		for (int trial : Range<>(5))
+		{
+			for (int i : Range<>(nqubit)) perm[i] = i;
+			rand_shuffle(perm);
+			VectorXcf oldAmp = VectorXcf(q);
+			VectorXcf expected(oldAmp.size());
+			for (qubase base : QubaseRange(nqubit))
+			{
+				qubase newBase = 0;
+				for (int i = 0; i < nqubit; ++i)
+					if (base & q.to_qubase(i))
+						newBase |= q.to_qubase(perm[i]);
+				expected(newBase) = oldAmp(base);
+			}
+
+			permute_qubits(q, perm);
+			ASSERT_MAT(expected, VectorXcf(q), "Qubit i should move to perm[i]");
+		}
+	}
+}
@@ -0,0 +1,444 @@
+#include "tests.h"
+
+TEST(Qureg, OracleSubsets)
+{
+	vector<int> perm;
+	for (int nqubit : QubitRange(3))
+	{
+		Qureg qd = rand_qureg_dense(nqubit, 1);
+		Qureg qs1 = rand_qureg_sparse(nqubit, half_fill(nqubit), 2, false);
+		Qureg qs2 = rand_qureg_sparse(nqubit, half_fill(nqubit) / 2 + 1, 1, true);
+		Qureg QQs[] = { move(qd), move(qs1), move(qs2) };
+
+		perm.resize(nqubit);
+		for (Qureg& q : QQs)
+		for (int trial : Range<>(10))
+		{
+			for (int i : Range<>(nqubit)) perm[i] = i;
+			rand_shuffle(perm);
+			// interleaved input/output lists, possibly with spectator qubits left over
+			int nin = rand_int(1, nqubit - 1);
+			int nout = rand_int(1, nqubit - nin + 1);
+			vector<int> inputs(perm.begin(), perm.begin() + nin);
+			vector<int> outputs(perm.begin() + nin, perm.begin() + nin + nout);
+			if (trial % 2 == 0)
+				std::sort(inputs.begin(), inputs.end()); // PEXT/PDEP path
+			uint64_t salt = rand_int(0, 1 << nout);
+			oracle_function oracle = [=](uint64_t x) { return (x * 7 + salt) % (1 << nout); };
+
+			VectorXcf oldAmp = VectorXcf(q);
+			VectorXcf expected = VectorXcf::Zero(oldAmp.size());
+			for (qubase base : QubaseRange(nqubit))
+			{
+				uint64_t x = 0;
+				for (int qi : inputs)
+					x = (x << 1) | ((base & q.to_qubase(qi)) != 0);
+				uint64_t fx = oracle(x);
+				qubase newBase = base;
+				for (int i = 0; i < nout; ++i)
+					if (fx & (1 << (nout - 1 - i)))
+						newBase ^= q.to_qubase(outputs[i]);
+				expected(newBase) = oldAmp(base);
+			}
+
+			apply_oracle(q, oracle, inputs, outputs);
+			ASSERT_MAT(expected, VectorXcf(q), "Oracle on qubit subsets");
+		}
+	}
+}
+
+TEST(Qureg, OracleSubsetsContiguous)
+{
+	for (int nqubit : QubitRange(3))
+	for (int dense : Range<>(2))
+	{
+		Qureg q = dense ?
+			rand_qureg_dense(nqubit, 1) :
+			rand_qureg_sparse(nqubit, half_fill(nqubit), 1);
+		int nin = rand_int(1, nqubit);
+		vector<int> inputs, outputs;
+		for (int qi : Range<>(nqubit))
+			(qi < nin ? inputs : outputs).push_back(qi);
+		oracle_function oracle = [=](uint64_t x) { return (x * x + 3) % (1 << (nqubit - nin)); };
+
+		Qureg qc = q.clone();
+		apply_oracle(qc, oracle, nin);
+		apply_oracle(q, oracle, inputs, outputs);
+		ASSERT_MAT(VectorXcf(qc), VectorXcf(q), "Subset oracle should agree with top-bits oracle");
+	}
+}
+
+TEST(Qureg, MeasureShortSum)
+{
+	// probabilities summing below 1: the draw runs past every base, 
+	// measure() still has to return the one that is stored
+	for (int nqubit : { 4, 16 })
+	for (int dense : Range<>(2))
+	{
+		qubase base = (qubase(1) << nqubit) / 3;
+		Qureg q = dense ?
+			Qureg::create<true>(nqubit, base) :
+			Qureg::create<false>(nqubit, 1, base);
+		if (dense)
+			q.set_base_d(base, CX(.1f));
+		else
+			q[base] = CX(.1f);
+		for (int trial : Range<>(20))
+			ASSERT_EQ(base, measure(q)) << "trial " << trial;
+	}
+}
+
+TEST(Qureg, TopKStates)
+{
+	typedef pair<qubase, float> qentry;
+	for (int nqubit : { 3, 6, 10, 16 })
+	for (int dense : Range<>(2))
+	{
+		Qureg q = dense ?
+			rand_qureg_dense(nqubit, 1) :
+			rand_qureg_sparse(nqubit, half_fill(nqubit), 1);
+		q.sort(); // must keep amp[] aligned with basis[]
+		// reference: full sort of every state
+		VectorXcf vec = VectorXcf(q);
+		vector<qentry> all;
+		for (qubase base : QubaseRange(nqubit))
+			if (cx_norm(vec(base)) > TOL)
+				all.push_back(qentry(base, cx_norm(vec(base))));
+		std::sort(all.begin(), all.end(), [](const qentry& x1, const qentry& x2)
+		{
+			return x1.second != x2.second ? x1.second > x2.second : x1.first < x2.first;
+		});
+
+		for (size_t k : { size_t(1), size_t(5), all.size() / 2 + 1 })
+		{
+			auto top = q.top_k_states(k);
+			ASSERT_EQ(min(k, all.size()), top.size()) << "top_k size";
+			for (size_t i = 0; i < top.size(); ++i)
+				ASSERT_EQ(all[i].first, top[i].first) << "top_k rank " << i;
+		}
+
+		float cutoff = all[all.size() / 3].second;
+		auto above = q.top_k_states(0, cutoff);
+		size_t expected = 0;
+		while (expected < all.size() && all[expected].second > cutoff) ++expected;
+		ASSERT_EQ(expected, above.size()) << "threshold mode";
+		ASSERT_EQ(all.size(), q.sorted_non_zero_states().size());
+	}
+}
+
+TEST(Qureg, Sample)
+{
+	const size_t shots = 20000;
+	for (int nqubit : { 3, 6 })
+	for (int dense : Range<>(2))
+	{
+		Qureg q = dense ?
+			rand_qureg_dense(nqubit, 1) :
+			rand_qureg_sparse(nqubit, half_fill(nqubit), 1);
+		VectorXcf vec = VectorXcf(q);
+		// marginal over a shuffled subset of qubits
+		vector<int> qubits = { nqubit - 1, 0 };
+		auto hist = sample_histogram(q, shots, qubits);
+
+		for (uint64_t outcome : Range<>(4))
+		{
+			float prob = 0;
+			for (qubase base : QubaseRange(nqubit))
+				if (((base & q.to_qubase(qubits[0])) != 0) == ((outcome >> 1) & 1)
+					&& ((base & q.to_qubase(qubits[1])) != 0) == (outcome & 1))
+					prob += cx_norm(vec(base));
+			ASSERT_NEAR(prob / vec.squaredNorm(), float(hist[outcome]) / shots, 0.02) << "outcome " << outcome;
+		}
+		ASSERT_MAT(vec, VectorXcf(q), "sample() must not alter the register");
+
+		rand_seed(7);
+		auto shots1 = sample(q, 10000);
+		rand_seed(7);
+		ASSERT_EQ(shots1, sample(q, 10000)) << "rand_seed() should fix the shots";
+
+		// a RandScope fixes the shots on its own and leaves rand() alone
+		vector<uint64_t> scoped1, scoped2;
+		rand_seed(7);
+		{
+			RandScope scope(11);
+			scoped1 = sample(q, 1000);
+		}
+		int next = rand();
+		rand_seed(3);
+		{
+			RandScope scope(11);
+			scoped2 = sample(q, 1000);
+		}
+		ASSERT_EQ(scoped1, scoped2) << "RandScope should fix the shots";
+		rand_seed(7);
+		ASSERT_EQ(next, rand()) << "RandScope must not draw from rand()";
+	}
+}
+
+TEST(Qureg, MeasureRange)
+{
+	for (int nqubit : QubitRange(3))
+	for (int dense : Range<>(2))
+	for (int trial : Range<>(5))
+	{
+		Qureg q = dense ?
+			rand_qureg_dense(nqubit, 1) :
+			rand_qureg_sparse(nqubit, half_fill(nqubit), 1);
+		int start = rand_int(0, nqubit - 1);
+		int size = rand_int(1, nqubit - start + 1);
+		int shift = nqubit - start - size;
+		VectorXcf oldAmp = VectorXcf(q);
+
+		uint64_t result = measure_range(q, start, size);
+		// expected: the old state projected onto the outcome, renormalized
+		VectorXcf expected = VectorXcf::Zero(oldAmp.size());
+		for (qubase base : QubaseRange(nqubit))
+			if (((base >> shift) & ((1 << size) - 1)) == result)
+				expected(base) = oldAmp(base);
+		ASSERT_GT(expected.squaredNorm(), 0) << "outcome " << result << " is impossible";
+		expected /= expected.norm();
+		ASSERT_MAT(expected, VectorXcf(q), "collapse after measure_range");
+	}
+}
+
+TEST(Qureg, Marginals)
+{
+	for (int nqubit : QubitRange(3))
+	for (int dense : Range<>(2))
+	{
+		Qureg q = dense ?
+			rand_qureg_dense(nqubit, 1) :
+			rand_qureg_sparse(nqubit, half_fill(nqubit), 1);
+		VectorXcf vec = VectorXcf(q);
+
+		vector<float> probs = marginals(q);
+		ASSERT_EQ(nqubit, probs.size());
+		for (int qi : Range<>(nqubit))
+		{
+			float expected = 0;
+			for (qubase base : QubaseRange(nqubit))
+				if (base & q.to_qubase(qi))
+					expected += cx_norm(vec(base));
+			ASSERT_NEAR(expected, probs[qi], TOL * 10 * max(1.0f, expected)) << "P(qubit " << qi << " = 1)";
+		}
+
+		int start = rand_int(0, nqubit - 1);
+		int size = rand_int(1, nqubit - start + 1);
+		vector<float> hist = marginal_distribution(q, start, size);
+		ASSERT_EQ(1 << size, hist.size());
+		vector<float> expected(1 << size, 0);
+		for (qubase base : QubaseRange(nqubit))
+			expected[(base >> (nqubit - start - size)) & ((1 << size) - 1)] += cx_norm(vec(base));
+		for (int value : Range<>(1 << size))
+			ASSERT_NEAR(expected[value], hist[value], TOL * 10 * max(1.0f, expected[value])) << "value " << value;
+	}
+}
+
+TEST(Qureg, LazyCollapse)
+{
+	for (int nqubit : QubitRange(3))
+	for (int dense : Range<>(2))
+	{
+		Qureg q = dense ?
+			rand_qureg_dense(nqubit, 1) :
+			rand_qureg_sparse(nqubit, half_fill(nqubit), 1);
+		normalize(q);
+		VectorXcf oldAmp = VectorXcf(q);
+
+		// two pending collapses, read back before anything settles
+		int t1 = rand_int(0, nqubit), t2 = (t1 + 1) % nqubit;
+		int r1 = measure(q, t1);
+		int r2 = measure(q, t2);
+		Qureg qi = q.clone(); // keeps the pending collapse
+		ASSERT_EQ(r1, measure(q, t1, false)) << "a measured qubit must stay measured";
+		ASSERT_EQ(r2, measure_range(q, t2, 1, false));
+		vector<float> probs = marginals(q);
+		ASSERT_NEAR(r1, probs[t1], TOL * 10);
+		ASSERT_NEAR(r2, probs[t2], TOL * 10);
+
+		VectorXcf expected = VectorXcf::Zero(oldAmp.size());
+		for (qubase base : QubaseRange(nqubit))
+			if (((base & q.to_qubase(t1)) != 0) == r1 && ((base & q.to_qubase(t2)) != 0) == r2)
+				expected(base) = oldAmp(base);
+		expected /= expected.norm();
+		for (qubase base : QubaseRange(nqubit))
+		{
+			CX a = q.get_amp(base);
+			ASSERT_CX_EQ(expected(base), a, "get_amp with a pending collapse", TOL * 10);
+		}
+		// size() settles first: only the surviving sparse bases are counted
+		size_t survivors = 0;
+		for (qubase base : QubaseRange(nqubit))
+			survivors += expected(base) != CX(0);
+		ASSERT_EQ(dense ? size_t(oldAmp.size()) : survivors, q.size());
+		if (!dense)
+		{
+			// base_iter_s() settles before the loop, operator[] can't compact under it
+			size_t visited = 0;
+			for (qubase base : qi.base_iter_s())
+			{
+				qi[base] *= 2;
+				++visited;
+			}
+			ASSERT_EQ(survivors, visited);
+			ASSERT_MAT(VectorXcf(expected * 2), VectorXcf(qi), "base_iter_s with a pending collapse", TOL * 20);
+		}
+
+		// a gate settles first
+		Matrix2cf mat = rand_cxmat(2, 2);
+		int tar = rand_int(0, nqubit);
+		generic_gate(q, mat, tar);
+		Qureg qe = Qureg::create<true>(nqubit, qubase(0));
+		for (qubase base : QubaseRange(nqubit))
+			qe.set_base_d(base, expected(base));
+		generic_gate(qe, mat, tar);
+		ASSERT_MAT(VectorXcf(qe), VectorXcf(q), "gate after a pending collapse", TOL * 10);
+	}
+}
+
+TEST(Qureg, MeasureAndRemove)
+{
+	for (int nqubit : QubitRange(3))
+	for (int dense : Range<>(2))
+	{
+		Qureg q = dense ?
+			rand_qureg_dense(nqubit, 1) :
+			rand_qureg_sparse(nqubit, half_fill(nqubit), 1);
+		normalize(q);
+		VectorXcf oldAmp = VectorXcf(q);
+		// a pending collapse elsewhere must be applied too
+		int t0 = rand_int(0, nqubit);
+		int r0 = measure(q, t0);
+		int tar = (t0 + rand_int(1, nqubit)) % nqubit;
+		int result = measure_and_remove(q, tar);
+		ASSERT_EQ(nqubit - 1, q.nqubit);
+		if (dense)
+			ASSERT_EQ(size_t(1) << (nqubit - 1), q.size());
+
+		// expected: project, then drop the bit of 'tar'
+		int k = nqubit - 1 - tar; // bit position of tar
+		VectorXcf expected = VectorXcf::Zero(1 << (nqubit - 1));
+		for (qubase base : QubaseRange(nqubit))
+			if (((base >> k) & 1) == result && ((base >> (nqubit - 1 - t0)) & 1) == r0)
+				expected(((base >> (k + 1)) << k) | (base & ((1 << k) - 1))) = oldAmp(base);
+		expected /= expected.norm();
+		ASSERT_MAT(expected, VectorXcf(q), "measure_and_remove", TOL * 10);
+	}
+}
+
+TEST(Qureg, ResetAndFeedForward)
+{
+	for (int nqubit : QubitRange(3))
+	for (int dense : Range<>(2))
+	for (int trial : Range<>(4))
+	{
+		Qureg q = dense ?
+			rand_qureg_dense(nqubit, 1) :
+			rand_qureg_sparse(nqubit, half_fill(nqubit), 1);
+		Qureg qc = q.clone();
+		int tar = rand_int(0, nqubit);
+		int c = (tar + rand_int(1, nqubit)) % nqubit;
+
+		// same rand() stream gives the same outcomes
+		int seed = rand();
+		rand_seed(seed);
+		int m = measure(q, c);
+		int r = reset(q, tar);
+		pauli_correct(q, (tar + 1) % nqubit, trial & 1, trial & 2);
+
+		rand_seed(seed);
+		ASSERT_EQ(m, measure(qc, c));
+		ASSERT_EQ(r, measure(qc, tar));
+		if (r)
+			pauli_X(qc, tar);
+		if (trial & 1)
+			pauli_X(qc, (tar + 1) % nqubit);
+		if (trial & 2)
+			pauli_Z(qc, (tar + 1) % nqubit);
+
+		ASSERT_NEAR(0, marginals(q)[tar], TOL * 10) << "reset qubit must be |0>";
+		ASSERT_MAT(VectorXcf(qc), VectorXcf(q), "reset and pauli_correct", TOL * 10);
+	}
+}
+
+TEST(Qureg, ApplyPermutation)
+{
+	vector<int> perm;
+	for (int nqubit : QubitRange(3))
+	for (int dense : Range<>(2))
+	{
+		Qureg q = dense ?
+			rand_qureg_dense(nqubit, 1) :
+			rand_qureg_sparse(nqubit, half_fill(nqubit), 1);
+		perm.resize(nqubit);
+		for (int i : Range<>(nqubit)) perm[i] = i;
+		rand_shuffle(perm);
+		int ntar = rand_int(1, nqubit);
+		vector<int> tars(perm.begin(), perm.begin() + ntar);
+		vector<int> ctrls(perm.begin() + ntar, perm.begin() + rand_int(ntar, nqubit) + 1);
+		// odd multiplier: a bijection mod 2^ntar
+		uint64_t mul = rand_int(0, 1 << ntar) | 1, add = rand_int(0, 1 << ntar);
+		oracle_function f = [=](uint64_t x) { return (x * mul + add) & ((1 << ntar) - 1); };
+
+		VectorXcf oldAmp = VectorXcf(q);
+		VectorXcf expected = VectorXcf::Zero(oldAmp.size());
+		for (qubase base : QubaseRange(nqubit))
+		{
+			bool on = true;
+			for (int c : ctrls)
+				on = on && (base & q.to_qubase(c));
+			uint64_t x = 0;
+			for (int t : tars)
+				x = (x << 1) | ((base & q.to_qubase(t)) != 0);
+			qubase newBase = base;
+			if (on)
+				for (int i = 0; i < ntar; ++i)
+					if (((f(x) >> (ntar - 1 - i)) & 1) != ((x >> (ntar - 1 - i)) & 1))
+						newBase ^= q.to_qubase(tars[i]);
+			expected(newBase) = oldAmp(base);
+		}
+		apply_permutation(q, f, tars, ctrls);
+		ASSERT_MAT(expected, VectorXcf(q), "apply_permutation");
+	}
+}
+
+TEST(Qureg, ClosedFormStates)
+{
+	for (int nqubit : QubitRange(2))
+	for (int dense : Range<>(2))
+	{
+		int startBit = rand_int(0, nqubit);
+		int qsize = rand_int(1, nqubit - startBit + 1);
+		qubase initBase = rand_int(0, 1 << nqubit);
+		auto basis_state = [&]()
+		{
+			return dense ?
+				Qureg::create<true>(nqubit, initBase) :
+				Qureg::create<false>(nqubit, 1, initBase);
+		};
+
+		Qureg expected = basis_state();
+		for (int tar = startBit; tar < startBit + qsize; ++tar)
+			hadamard(expected, tar);
+		Qureg q = dense ?
+			Qureg::create_uniform<true>(nqubit, startBit, qsize, initBase) :
+			Qureg::create_uniform<false>(nqubit, startBit, qsize, initBase);
+		ASSERT_MAT(VectorXcf(expected), VectorXcf(q), "create_uniform");
+
+		expected = basis_state();
+		qft(expected, startBit, qsize);
+		q = dense ?
+			Qureg::create_qft<true>(nqubit, startBit, qsize, initBase) :
+			Qureg::create_qft<false>(nqubit, startBit, qsize, initBase);
+		ASSERT_MAT(VectorXcf(expected), VectorXcf(q), "create_qft");
+
+		expected = dense ?
+			Qureg::create<true>(nqubit, qubase(0)) :
+			Qureg::create<false>(nqubit, 1, qubase(0));
+		hadamard(expected, 0);
+		for (int tar = 1; tar < nqubit; ++tar)
+			cnot(expected, 0, tar);
+		q = dense ? Qureg::create_ghz<true>(nqubit) : Qureg::create_ghz<false>(nqubit);
+		ASSERT_MAT(VectorXcf(expected), VectorXcf(q), "create_ghz");
+	}
+}
@@ -97,4 +97,20 @@ inline size_t half_fill(int nqubit)
 	return (1 << nqubit) / 2 + 1;
 }
 
+/*
+ *	Scale to unit norm: measurement assumes a normalized state
+ */
+inline Qureg& normalize(Qureg& q)
+{
+	VectorXcf vec = VectorXcf(q);
+	float norm = vec.norm();
+	if (q.dense)
+		DENSE_ITER(base)
+			q.set_base_d(base, vec(base) / norm);
+	else
+		for (qubase& base : q.base_iter_s())
+			q[base] /= norm;
+	return q;
+}
+
 #endif // tests_h__
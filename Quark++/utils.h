@@ -19,7 +19,10 @@
 #include <queue>
 #include <unordered_map>
 #include <unordered_set>
+#include <random>
+#include <atomic>
 #include <Eigen/Dense>
+#include <Eigen/SparseCore>
 #include "frac.h"
 #include "prettyprint.h"
 
@@ -46,6 +49,111 @@ typedef unsigned long long qubase;
 #  define INLINE  inline
 #endif
 
+// BMI2 bit gather/scatter (PEXT/PDEP), enabled by -mbmi2 or /arch:AVX2
+#if defined(__BMI2__) || (defined(_MSC_VER) && defined(__AVX2__))
+#  define QUARK_BMI2
+#  include <immintrin.h>
+#endif
+
+/*
+ * Hot kernels are compiled once per ISA level in the same binary.
+ * The loader picks the best clone for the running CPU once (GNU ifunc),
+ * so plain -O3 builds still get AVX2/AVX-512 code where available.
+ * Eigen's own packet math stays at the ISA of the compiler flags.
+ * Define QUARK_NO_MULTI_ISA to build single-variant kernels.
+ */
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) \
+	&& defined(__linux__) && !defined(QUARK_NO_MULTI_ISA)
+#  define MULTI_ISA __attribute__((target_clones( \
+		"arch=skylake-avx512", "arch=haswell", "sse4.2", "default")))
+#else
+#  define MULTI_ISA
+#endif
+
+/*
+ * OpenMP loops. A loop only forks when it has more than PARALLEL_MIN
+ * iterations, so small registers don't pay for the thread team.
+ * Loop variables must be signed (int64_t) for MSVC's OpenMP 2.0.
+ * OMP_FOR_SUM(var, n): parallel sum reduction into 'var' (also SIMD on OpenMP 4+)
+ * OMP_FOR_TASKS(cond): dynamic schedule, for a few coarse independent jobs.
+ *   Forks only if 'cond', e.g. while the jobs' registers are too small for OMP_FOR
+ * OMP_PARALLEL(cond): if 'cond', every thread runs the next block.
+ * OMP_CRITICAL(name): one at a time
+ * Without -fopenmp (/openmp) they expand to nothing.
+ */
+#define PARALLEL_MIN (1 << 14)
+#ifdef _MSC_VER
+#  define QUARK_PRAGMA(x) __pragma(x)
+#else
+#  define QUARK_PRAGMA(x) _Pragma(#x)
+#endif
+#if defined(_OPENMP) && _OPENMP >= 201307
+#  define OMP_FOR(n) QUARK_PRAGMA(omp parallel for if((n) > PARALLEL_MIN))
+#  define OMP_FOR_SUM(var, n) \
+	QUARK_PRAGMA(omp parallel for simd reduction(+:var) if((n) > PARALLEL_MIN))
+#elif defined(_OPENMP)
+#  define OMP_FOR(n) QUARK_PRAGMA(omp parallel for if((n) > PARALLEL_MIN))
+#  define OMP_FOR_SUM(var, n) \
+	QUARK_PRAGMA(omp parallel for reduction(+:var) if((n) > PARALLEL_MIN))
+#else
+#  define OMP_FOR(n)
+#  define OMP_FOR_SUM(var, n)
+#endif
+#ifdef _OPENMP
+#  define OMP_FOR_TASKS(cond) QUARK_PRAGMA(omp parallel for schedule(dynamic, 1) if(cond))
+#  define OMP_PARALLEL(cond) QUARK_PRAGMA(omp parallel if(cond))
+#  define OMP_CRITICAL(name) QUARK_PRAGMA(omp critical(name))
+#else
+#  define OMP_FOR_TASKS(cond)
+#  define OMP_PARALLEL(cond)
+#  define OMP_CRITICAL(name)
+#endif
+
+///////************** Complex arithmetic **************///////
+/*
+ * Kernel-side complex float math. std::complex operator* lowers to the
+ * C99 Annex G routine __mulsc3 (NaN/Inf recovery) unless the user builds
+ * with -fcx-limited-range, and libstdc++'s std::norm takes a hypot-based
+ * abs() and squares it. These are plain mul/add, which compile to 
+ * straight-line (FMA where available) code under any flags.
+ * Eigen's own complex products (the GEMM tiles, apply_controlled) get the 
+ * same plain multiply from -fcx-limited-range, set in the Makefile.
+ */
+INLINE CX cx_mul(const CX& a, const CX& b)
+{
+	return CX(a.real() * b.real() - a.imag() * b.imag(),
+			  a.real() * b.imag() + a.imag() * b.real());
+}
+INLINE CX cx_mul(REAL a, const CX& b)
+{
+	return CX(a * b.real(), a * b.imag());
+}
+INLINE CX cx_mul(const CX& a, REAL b) { return cx_mul(b, a); }
+
+// a * b + c
+INLINE CX cx_fma(const CX& a, const CX& b, const CX& c)
+{
+	return CX(a.real() * b.real() - a.imag() * b.imag() + c.real(),
+			  a.real() * b.imag() + a.imag() * b.real() + c.imag());
+}
+INLINE CX cx_fma(REAL a, const CX& b, const CX& c)
+{
+	return CX(a * b.real() + c.real(), a * b.imag() + c.imag());
+}
+
+// conj(a) * b
+INLINE CX cx_conj_mul(const CX& a, const CX& b)
+{
+	return CX(a.real() * b.real() + a.imag() * b.imag(),
+			  a.real() * b.imag() - a.imag() * b.real());
+}
+
+// |a|^2
+INLINE REAL cx_norm(const CX& a)
+{
+	return a.real() * a.real() + a.imag() * a.imag();
+}
+
 /*
 *	For initializing static variables only once
 *   Variadic macro technique
@@ -60,19 +168,61 @@ INLINE void rand_seed(int seed = -1)
 	srand(seed < 0 ? time(NULL) : seed);
 }
 
+/*
+ *	Engine of the calling thread, set by RandScope. Null: use rand()
+ */
+INLINE std::mt19937*& thread_rand_engine()
+{
+	static thread_local std::mt19937* engine = nullptr;
+	return engine;
+}
+
+/*
+ *	Next draw in [0, RAND_MAX], from the thread's engine if any, else rand()
+ */
+INLINE int rand_next()
+{
+	std::mt19937* engine = thread_rand_engine();
+	return engine ? int((*engine)() % (unsigned(RAND_MAX) + 1)) : rand();
+}
+
+/*
+ *	While in scope, the rand_*() of this thread draw from a mt19937 of 
+ * its own. Concurrent jobs each seeded up front draw the same numbers 
+ * however their threads interleave
+ */
+class RandScope
+{
+	std::mt19937 own;
+	std::mt19937* prev;
+	RandScope(const RandScope&);
+	RandScope& operator=(const RandScope&);
+public:
+	explicit RandScope(unsigned seed) : own(seed), prev(thread_rand_engine())
+	{
+		thread_rand_engine() = &own;
+	}
+	// draw from a shared engine instead, e.g. inside a critical section
+	explicit RandScope(std::mt19937& engine) : prev(thread_rand_engine())
+	{
+		thread_rand_engine() = &engine;
+	}
+	~RandScope() { thread_rand_engine() = prev; }
+};
+
 INLINE int rand_int(int low, int high)
 {
-	return rand() % (high - low) + low;
+	return rand_next() % (high - low) + low;
 }
 
 INLINE double rand_double()
 {
-	return (double)rand() / RAND_MAX;
+	return (double)rand_next() / RAND_MAX;
 }
 
 INLINE float rand_float(float low = 0, float high = 1)
 {
-	float f = (float) rand() / RAND_MAX;
+	float f = (float) rand_next() / RAND_MAX;
 	return low + f * (high - low);
 }
 
@@ -215,6 +365,72 @@ INLINE int bit_count(uint64_t b)
 	return bit_count<true>(b);
 }
 
+// Index of the lowest set bit, b must be non-zero
+INLINE int bit_ctz(uint64_t b)
+{
+#if defined(_MSC_VER)
+	unsigned long i;
+	_BitScanForward64(&i, b);
+	return (int)i;
+#else
+	return __builtin_ctzll(b);
+#endif
+}
+
+/*
+ *	Parallel bit extract (PEXT): pack the bits of 'b' selected by 'mask'
+ * into the low bits of the result, keeping their relative order
+ */
+INLINE uint64_t bit_gather(uint64_t b, uint64_t mask)
+{
+#ifdef QUARK_BMI2
+	return _pext_u64(b, mask);
+#else
+	uint64_t ans = 0;
+	for (uint64_t bb = 1; mask; bb <<= 1)
+	{
+		if (b & mask & -mask)
+			ans |= bb;
+		mask &= mask - 1; // clear the lowest set bit
+	}
+	return ans;
+#endif
+}
+
+/*
+ *	Parallel bit deposit (PDEP): spread the low bits of 'b'
+ * to the positions selected by 'mask'. Inverse of bit_gather()
+ */
+INLINE uint64_t bit_scatter(uint64_t b, uint64_t mask)
+{
+#ifdef QUARK_BMI2
+	return _pdep_u64(b, mask);
+#else
+	uint64_t ans = 0;
+	for (uint64_t bb = 1; mask; bb <<= 1)
+	{
+		if (b & bb)
+			ans |= mask & -mask;
+		mask &= mask - 1;
+	}
+	return ans;
+#endif
+}
+
+/*
+ *	The i-th subset of 'mask' in ascending order, 'prev' holding the (i-1)-th.
+ * PDEP deposits it from scratch. Without BMI2, the increment trick
+ * carries through the bits outside 'mask' in O(1).
+ */
+INLINE qubase masked_next(qubase i, qubase& prev, qubase mask)
+{
+#ifdef QUARK_BMI2
+	return prev = _pdep_u64(i, mask);
+#else
+	return prev = i ? ((prev | ~mask) + 1) & mask : 0;
+#endif
+}
+
 /*
  *	Bitwise dot-product
  */